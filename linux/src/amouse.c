@@ -26,11 +26,20 @@
 #include "include/version.h"
 #include "include/utils.h"
 #include "include/serial.h"
+#include "include/mouse.h"
+#include "include/input.h"
+#include "include/accel.h"
+#include "include/record.h"
+#include "include/histogram.h"
+#include "include/realtime.h"
 
 // Linux specific
 #include <sys/ioctl.h> // ioctl (serial pins, mouse exclusive access)
-#include <libevdev.h>  // input dev
-#include <getopt.h>    // getopt
+#include <getopt.h>    // getopt_long
+#include <signal.h>    // sigprocmask()
+#include <sys/epoll.h>    // epoll, event loop
+#include <sys/timerfd.h>  // timerfd, transmit pacing
+#include <sys/signalfd.h> // signalfd, clean shutdown
 
 /*** Program parameters ***/ 
 
@@ -42,50 +51,208 @@ R"#(  __ _   _ __  ___ _  _ ___ ___
 void showhelp(char *argv[]) {
   printf("%s\n\n", title);
   printf("Anachro Mouse v%d.%d.%d, a usb to serial mouse adaptor.\n" \
-         "Usage: %s -m <mouse_input> -s <serial_output>\n\n" \
-         "  -m <File> to read mouse input from (/dev/input/*)\n" \
+         "Usage: %s -m <mouse_input> -s <serial_output>\n" \
+         "       %s -c <config_file>\n\n" \
+         "  -m <File> to read mouse input from (/dev/input/*), repeat or use a glob to merge several mice\n" \
          "  -s <File> to write to serial port with (/dev/tty*)\n" \
+         "  -c <File> listing one mouse to serial binding per line, using these same options\n" \
+         "  -p <Protocol> to emulate: microsoft (default), logitech, mousesystems\n" \
 	 "  -w Disable mousewheel, switch to basic MS protocol\n" \
 	 "  -e Disable exclusive access to mouse\n" \
 	 "  -i Immediate ident mode, disables waiting for CTS pin\n" \
-	 "  -d Print out debug information on mouse state\n", V_MAJOR, V_MINOR, V_REVISION, argv[0]);
+         "  -b <Counts> of motion allowed to carry over to later packets (default: unlimited)\n" \
+	 "  -d Print out debug information on mouse state\n" \
+         "  --record <File> to log mouse input events to, for replaying later\n" \
+         "  --replay <File> to read mouse input events from instead of a mouse, at the speed they were recorded\n" \
+         "  --fast Replay as fast as possible, pacing by a simulated clock instead of waiting for the serial line\n" \
+         "  --sensitivity <Percent> to scale motion by (default: 100)\n" \
+         "  --accel <Curve>[,rate[,limit]] pointer acceleration: flat (default), linear or quadratic,\n" \
+         "      gaining rate%% per count of speed (default: 10) up to limit%% (default: no limit)\n" \
+         "  --pacing <Mode> of packets: fixed (default) from line speed, or queue from the real output queue depth\n" \
+         "  --realtime <Priority> to run at with SCHED_FIFO (1-99), memory locked\n" \
+         "  --cpu <Number> of CPU core to pin amouse to\n" \
+         "  --drain Also time how long packets take to leave the serial port\n\n" \
+         "Latency histograms are printed on exit and on SIGUSR1.\n", V_MAJOR, V_MINOR, V_REVISION, argv[0], argv[0]);
 }
 
 // Struct for storing pointers to dynamically allocated memory containing options.
 struct opts {
-  char *mousepath; // Pointers, memory is dynamically allocated.
+  char *mousepaths[MAX_MOUSE_SOURCES]; // Pointers, memory is dynamically allocated.
+  int mousepath_count;
   char *serialpath;
+  char *configpath;
+  char *recordpath;
+  char *replaypath;
+  int replay_fast;
+  int drain;
+  int pacing;
+  int rt_priority; // SCHED_FIFO priority, 0 for normal scheduling
+  int cpu;         // Core to pin to, -1 for any
+  int sensitivity; // Percent
+  int accel_curve;
+  int accel_rate;  // Percent per count of speed
+  int accel_limit; // Percent, 0 for none
+  int protocol;
   int wheel;
   int exclusive;
   int immediate;
+  int max_backlog; // Motion carried beyond one packet, -1 for unlimited
   int debug;
 };
 
-// Struct for storing information about accumulated mouse state
-typedef struct mouse_state {
-  int pc_state; // Current state of mouse driver initialization on PC.
-  uint8_t state[4]; // Mouse state
-  int x, y, wheel;
-  int update; // How many bytes to send
-  int lmb, rmb, mmb, force_update;
-} mouse_state_t;
+// One mouse (or set of merged mice) to serial port pairing, with its own pacing and ident state.
+typedef struct binding {
+  struct opts options;
+  int opened;
+  mouse_input_t input;
+  int mice_open;
+  serial_port_t port;
+  struct termios old_tty;
+  mouse_state_t mouse;
+  modem_watch_t modem_watch;
+  int timer_fd;
+  int timer_armed;
+  int touched; // Had events in this loop iteration, check whether to transmit
+  struct timespec time_target;
+  record_t record;   // --record, log of input events
+  record_t replay;   // --replay, stands in for the mice
+  int replay_fd;     // Timer for feeding replayed events
+  int replay_source; // Next replayed event, read ahead to know when it's due
+  struct input_event replay_ev;
+  int replay_done;
+  struct timespec replay_start; // When the first replayed event is due
+  struct timespec clock;        // Simulated clock of fast replay
+  struct timespec window_start; // First event of what's waiting to be sent
+  int window_open;
+  accel_t accel;
+  histogram_t latency;          // Microseconds from first event of a packet to writing it
+  histogram_t drain_latency;    // Microseconds from write until the tty has sent it, with --drain
+  histogram_t wakeup_latency;   // Microseconds transmit timer wake ups were late by, scheduling jitter
+  unsigned long overruns;       // Wake ups so late the line had gone idle
+  struct timespec timer_target; // What the transmit timer was armed for
+  int watch_output;             // Serial port is registered for EPOLLOUT, a packet is half written
+  drain_watch_t drain;
+} binding_t;
+
+#define MAX_BINDINGS 32
+#define REPLAY_FAST_BATCH 64 // Replayed events between letting the rest of the loop run
+
+// Sources of events for the main loop. Which binding is in the upper bits, which of its mice in the middle.
+#define EVENT_TYPE(tag)    ((tag) & 0xff)
+#define EVENT_INDEX(tag)   (((tag) >> 8) & 0xff)
+#define EVENT_BINDING(tag) ((tag) >> 16)
+#define EVENT_TAG(type, binding, index) ((type) | ((index) << 8) | ((binding) << 16))
+
+enum EVENT_SOURCES {
+  EVENT_MOUSE    = 0,
+  EVENT_SERIAL   = 1,
+  EVENT_TXTIMER  = 2, // Serial transmit pacing
+  EVENT_MODEM    = 3, // Modem line changes, PC mouse driver init
+  EVENT_SIGNAL   = 4,
+  EVENT_HOTPLUG  = 5, // Something changed under /dev/input, mice coming and going
+  EVENT_REPLAY   = 6  // Recorded events due
+};
+
+// States of mouse init request from PC
+enum PC_INIT_STATES {
+  CTS_UNINIT   = 0, // Initial state
+  CTS_LOW_INIT = 1, // CTS pin has been set low, wait for high.
+  CTS_TOGGLED  = 2  // CTS was low, now high -> do ident.
+};
 
-void parse_opts(int argc, char **argv, struct opts *options) {
+#define MAX_EVENTS 32
+
+void default_opts(struct opts *options) {
+  options->wheel = 1;
+  options->exclusive = 1;
+  options->max_backlog = -1;
+  options->sensitivity = 100;
+  options->cpu = -1;
+  options->accel_rate = 10;
+}
+
+// Parse options onto whatever is already in options, returns non-zero if they were not valid.
+int parse_opts(int argc, char **argv, struct opts *options) {
+  static struct option long_options[] = {
+    {"record", required_argument, NULL, 'R'},
+    {"replay", required_argument, NULL, 'P'},
+    {"fast",   no_argument,       NULL, 'F'},
+    {"drain",  no_argument,       NULL, 'D'},
+    {"sensitivity", required_argument, NULL, 'S'},
+    {"accel",  required_argument, NULL, 'A'},
+    {"pacing", required_argument, NULL, 'T'},
+    {"realtime", required_argument, NULL, 'X'},
+    {"cpu",    required_argument, NULL, 'U'},
+    {NULL, 0, NULL, 0}
+  };
   int option_index = 0;
   int quit = 0;
 
-  while (( option_index = getopt(argc, argv, "hm:s:weid")) != -1) {
-    // Defaults
-    options->wheel = 1;
-    options->exclusive = 1;
-
+  optind = 0; // Full getopt reset, we also parse config file lines.
+  while (( option_index = getopt_long(argc, argv, "hm:s:c:p:weib:d", long_options, NULL)) != -1) {
     switch(option_index) {
       case 'm':
-        options->mousepath = strndup(optarg, 4096); // Max path size is 4095, plus a null byte
+        if(options->mousepath_count >= MAX_MOUSE_SOURCES) {
+          fprintf(stderr, "Too many -m options, ignoring %s\n", optarg);
+          break;
+        }
+        options->mousepaths[options->mousepath_count++] = strndup(optarg, 4096); // Max path size is 4095, plus a null byte
         break;
       case 's':
         options->serialpath = strndup(optarg, 4096);
         break;
+      case 'c':
+        options->configpath = strndup(optarg, 4096);
+        break;
+      case 'R':
+        options->recordpath = strndup(optarg, 4096);
+        break;
+      case 'P':
+        options->replaypath = strndup(optarg, 4096);
+        break;
+      case 'F':
+        options->replay_fast = 1;
+        break;
+      case 'D':
+        options->drain = 1;
+        break;
+      case 'X':
+        options->rt_priority = atoi(optarg);
+        break;
+      case 'U':
+        options->cpu = atoi(optarg);
+        break;
+      case 'T':
+        if(strcmp(optarg, "fixed") == 0) { options->pacing = PACING_FIXED; }
+        else if(strcmp(optarg, "queue") == 0) { options->pacing = PACING_QUEUE; }
+        else {
+          fprintf(stderr, "Unknown pacing mode '%s'.\n", optarg);
+          quit = 1;
+        }
+        break;
+      case 'S':
+        options->sensitivity = atoi(optarg);
+        break;
+      case 'A': {
+        char curve[16] = "";
+        sscanf(optarg, "%15[^,],%d,%d", curve, &options->accel_rate, &options->accel_limit);
+        options->accel_curve = accel_curve(curve);
+        if(options->accel_curve < 0) {
+          fprintf(stderr, "Unknown acceleration curve '%s'.\n", curve);
+          quit = 1;
+        }
+        break;
+      }
+
+      case 'p':
+        if(strcmp(optarg, "microsoft") == 0 || strcmp(optarg, "ms") == 0) { options->protocol = PROTO_MICROSOFT; }
+        else if(strcmp(optarg, "mousesystems") == 0 || strcmp(optarg, "msc") == 0) { options->protocol = PROTO_MOUSESYSTEMS; }
+        else if(strcmp(optarg, "logitech") == 0 || strcmp(optarg, "m3") == 0) { options->protocol = PROTO_LOGITECH; }
+        else {
+          fprintf(stderr, "Unknown protocol '%s'.\n", optarg);
+          quit = 1;
+        }
+        break;
 
       case 'h':
         showhelp(argv); exit(0);
@@ -99,6 +266,9 @@ void parse_opts(int argc, char **argv, struct opts *options) {
       case 'i':
 	options->immediate = 1; // Don't wait for CTS pin to ident
 	break;
+      case 'b':
+        options->max_backlog = atoi(optarg);
+        break;
       case 'd':
 	options->debug = 1; // Enable debug prints
 	break;
@@ -106,8 +276,14 @@ void parse_opts(int argc, char **argv, struct opts *options) {
         fprintf(stderr, "Invalid option on commandline, ignoring.\n");
     }
   }
+  return quit;
+}
 
-  if(options->mousepath == NULL) { 
+// Check one binding has everything it needs, returns non-zero if not.
+int check_opts(struct opts *options) {
+  int quit = 0;
+
+  if(options->mousepath_count == 0 && options->replaypath == NULL) { 
     fprintf(stderr, "You must define a path with -m to your mouse /dev/input/* file.\n");
     quit = 1;
   }
@@ -115,254 +291,786 @@ void parse_opts(int argc, char **argv, struct opts *options) {
     fprintf(stderr, "You must define a path with -s to your serial port /dev/tty* file.\n");
     quit = 1;
   }
-  if(quit != 0) { exit(0); }
+  if(options->recordpath != NULL && options->replaypath != NULL) {
+    fprintf(stderr, "Can't both --record and --replay.\n");
+    quit = 1;
+  }
+  if(options->protocol != PROTO_MICROSOFT) { options->wheel = 0; } // Wheel is a Microsoft extension
+  return quit;
 }
 
+// Read bindings from config file, one per line taking the same options as the commandline. Options given on the
+// commandline apply to every line as defaults. Returns new binding count or -1 on errors.
+int parse_config(struct opts *defaults, binding_t *bindings, int count) {
+  char line[4096];
+  char *args[64];
+  char *saveptr;
+  int argn, lineno = 0;
+  int quit = 0;
 
-/*** USB comms ***/
+  FILE *file = fopen(defaults->configpath, "r");
+  if(file == NULL) {
+    fprintf(stderr, "Config file %s open failed: %d: %s\n", defaults->configpath, errno, strerror(errno));
+    return -1;
+  }
 
-static int open_usbinput(const char* device, int exclusive) {
-  int fd;
-  int returncode = 1;
-  struct libevdev* dev;
+  while(fgets(line, sizeof(line), file) != NULL) {
+    lineno++;
+    line[strcspn(line, "#\n")] = '\0'; // Strip comments
 
-  fd = open(device, O_RDONLY | O_NONBLOCK);
-  if (fd < 0) { return -1; }
+    args[0] = defaults->configpath;
+    argn = 1;
+    for(char *arg = strtok_r(line, " \t\r", &saveptr); arg != NULL && argn < 63; arg = strtok_r(NULL, " \t\r", &saveptr)) {
+      args[argn++] = arg;
+    }
+    args[argn] = NULL;
+    if(argn == 1) { continue; } // Empty line
 
-  /* Check if it's a mouse */
-  returncode = libevdev_new_from_fd(fd, &dev);
-  if (returncode < 0) {
-    fprintf(stderr, "Error: %d %s\n", -returncode, strerror(-returncode));
-    return -1;
-  }
-  returncode = libevdev_has_event_type(dev, EV_REL) &&
-               libevdev_has_event_code(dev, EV_REL, REL_X) &&
-               libevdev_has_event_code(dev, EV_REL, REL_Y) &&
-               libevdev_has_event_code(dev, EV_KEY, BTN_LEFT) &&
-               libevdev_has_event_code(dev, EV_KEY, BTN_MIDDLE) &&
-               libevdev_has_event_code(dev, EV_KEY, BTN_RIGHT);
-  libevdev_free(dev);
+    if(count >= MAX_BINDINGS) {
+      fprintf(stderr, "Too many bindings, ignoring %s line %d\n", defaults->configpath, lineno);
+      continue;
+    }
+    bindings[count].options = *defaults;
+    bindings[count].options.mousepath_count = 0; // Devices are never shared between bindings
+    bindings[count].options.serialpath = NULL;
+    bindings[count].options.recordpath = NULL; // Neither are log files
+    bindings[count].options.replaypath = NULL;
 
-  if (returncode) { 
-    if(exclusive) { ioctl(fd, EVIOCGRAB, 1); } // Get exclusive mouse access
-    return fd;
+    if(parse_opts(argn, args, &bindings[count].options) != 0 || check_opts(&bindings[count].options) != 0) {
+      fprintf(stderr, "Invalid binding on %s line %d\n", defaults->configpath, lineno);
+      quit = 1;
+    }
+    // Scheduling is for the whole process, it can't differ between bindings.
+    if(bindings[count].options.rt_priority != defaults->rt_priority || bindings[count].options.cpu != defaults->cpu) {
+      fprintf(stderr, "--realtime and --cpu apply to all bindings, give them on the commandline not %s line %d\n",
+              defaults->configpath, lineno);
+      quit = 1;
+    }
+    count++;
   }
 
-  close(fd);
-  return -1;
+  fclose(file);
+  return quit ? -1 : count;
 }
 
 
 /*** Flow control functions ***/
 
-// Make sure we don't clobber higher update requests with lower ones.
-void push_update(mouse_state_t *mouse, int full_packet) {
-  if(full_packet || (mouse->update == 3)) { mouse->update = 3; }
-  else { mouse->update = 2; }
+// Accumulate a single evdev event into the mouse state. Motion from all devices is summed, buttons OR'ed.
+void process_mouse_event(mouse_state_t *mouse, struct opts *options, accel_t *accel, mouse_input_t *input,
+                         mouse_source_t *source, struct input_event *ev) {
+
+  /*** Handle mouse buttons ***/
+  if(ev->type == EV_KEY) {
+    switch(ev->code) {
+      case BTN_LEFT:
+        mouse->lmb = input_button(input, source, INPUT_LMB, ev->value);
+        mouse->force_update = 1;
+        push_update(mouse, mouse->mmb);
+        break;
+      case BTN_RIGHT:
+        mouse->rmb = input_button(input, source, INPUT_RMB, ev->value);
+        mouse->force_update = 1;
+        push_update(mouse, mouse->mmb);
+        break;
+      case BTN_MIDDLE:
+        if(options->wheel || options->protocol != PROTO_MICROSOFT) { // Basic MS protocol has no middle button
+          mouse->mmb = input_button(input, source, INPUT_MMB, ev->value);
+          mouse->force_update = 1;
+          push_update(mouse, 1); // Every time MMB changes (on or off), must send 4 bytes.
+        }
+        break;
+    }
+  }
+
+  /*** Handle relative movement ***/
+  else if (ev->type == EV_REL) {
+    switch(ev->code) {
+      case REL_X:
+        source->report_x += ev->value;
+        break;
+      case REL_Y:
+        source->report_y += ev->value;
+        break;
+      case REL_WHEEL:
+        if(options->wheel) {
+          mouse->wheel += ev->value;
+          cap_motion(&mouse->wheel, max_motion(options->max_backlog, MOUSE_WHEEL_MAX));
+          push_update(mouse, 1);
+        }
+        break;
+    }
+  }
+
+  /*** Scale motion once the report is complete, acceleration goes by the speed of the whole report ***/
+  else if (ev->type == EV_SYN && ev->code == SYN_REPORT && (source->report_x || source->report_y)) {
+    accel_apply(accel, &source->report_x, &source->report_y);
+    mouse_add_motion(mouse, source->report_x, source->report_y, protocol_motion_max(options->protocol), options->max_backlog);
+    if(source->report_x || source->report_y) { push_update(mouse, mouse->mmb); } // Might have scaled down to nothing yet
+    source->report_x = 0;
+    source->report_y = 0;
+  }
 }
 
+// Pack aggregated mouse state into a packet, send it and reset the aggregation window. Returns packet length.
+int mouse_send(serial_port_t *port, mouse_state_t *mouse, struct opts *options) {
+  int length = mouse_pack(mouse, options->protocol);
 
-/*** Main init & loop ***/
+  // Send updates
+  if(serial_write_packet(port, mouse->state, length) < 0 && options->debug) {
+    fprintf(stderr, "Packet dropped, port failed\n");
+  }
+  if(options->debug) {
+    for(int i=0; i < length; i++) {
+      fprintf(stderr, "Sent %d: %x\n", i, mouse->state[i]);
+      fprintf(stderr, "Mouse state(%d): %s\n", i, byte_to_bitstring(mouse->state[i]));
+    }
+    printf("\n");
+  }
 
-int main(int argc, char **argv) {
-  struct termios old_tty;
+  reset_mouse_state(mouse);
+  return length;
+}
 
-  // Parse commandline options
-  if(argc < 2) { showhelp(argv); exit(0); }
-  struct opts *options = (struct opts*) calloc(1, sizeof(struct opts)); // Memory is zeroed by calloc
-  if (options == NULL) {
-    fprintf(stderr, "Failed calloc() for opts: %d: %s\n", errno, strerror(errno));
-    exit(-1);
+// Handle data from the PC, only thing we understand are baud rate switch commands. Returns requested speed or 0.
+static int handle_serial_input(serial_port_t *port) {
+  uint8_t buffer[64];
+  ssize_t size;
+  int baud, requested = 0;
+
+  while((size = read(port->fd, buffer, sizeof(buffer))) > 0) {
+    for(int i=0; i < size; i++) {
+      baud = baud_command(buffer[i], &port->baud_star);
+      if(baud) { requested = baud; }
+    }
   }
-  parse_opts(argc, argv, options);
+  return requested;
+}
 
-  /*** USB mouse device input ***/
-  int mouse_fd = open_usbinput(options->mousepath, options->exclusive);
-  if(mouse_fd < 0) {
-    fprintf(stderr, "Mouse device file open() failed: %d: %s\n", errno, strerror(errno));
-    exit(-1);
+// Pick up merged button state after a device went away, it may have been holding buttons down.
+static void sync_buttons(mouse_state_t *mouse, mouse_input_t *input) {
+  int lmb = input->held[INPUT_LMB] > 0;
+  int rmb = input->held[INPUT_RMB] > 0;
+  int mmb = input->held[INPUT_MMB] > 0;
+
+  if(lmb != mouse->lmb || rmb != mouse->rmb || mmb != mouse->mmb) {
+    push_update(mouse, mmb != mouse->mmb); // Every time MMB changes (on or off), must send 4 bytes.
+    mouse->lmb = lmb;
+    mouse->rmb = rmb;
+    mouse->mmb = mmb;
+    mouse->force_update = 1;
   }
+}
 
-  struct input_event ev; // Input events
+// Start timing a packet from the first event that gave it something to send.
+static void binding_event_time(binding_t *binding, struct timespec *time) {
+  if(!binding->window_open && (binding->mouse.update > -1 || binding->mouse.force_update)) {
+    binding->window_start = *time;
+    binding->window_open = 1;
+  }
+}
+
+// Drain everything pending on a device, returns negative errno if the device can no longer be read.
+static int read_mouse(binding_t *binding, mouse_source_t *source) {
+  struct input_event ev;
   int returncode;
-  struct libevdev* mouse_dev;
 
-  // Create mouse device
-  returncode = libevdev_new_from_fd(mouse_fd, &mouse_dev);
-  if (returncode < 0) {
-    fprintf(stderr, "libedev_new failed: %d %s\n", -returncode, strerror(-returncode));
-    exit(-1);
+  while((returncode = input_next_event(source, &ev)) > 0) {
+    if(binding->record.file != NULL) { record_write(&binding->record, source - binding->input.sources, &ev); }
+    process_mouse_event(&binding->mouse, &binding->options, &binding->accel, &binding->input, source, &ev);
+
+    if(source->clock == CLOCK_MONOTONIC) {
+      struct timespec time = { ev.time.tv_sec, ev.time.tv_usec * 1000 };
+      binding_event_time(binding, &time);
+    }
+    else if(!binding->window_open) { // Timestamps from another clock, read time is the best we have
+      struct timespec time;
+      clock_gettime(CLOCK_MONOTONIC, &time);
+      binding_event_time(binding, &time);
+    }
+  }
+  return returncode;
+}
+
+// Register fd with epoll, tagging it with which source it is.
+static int watch_fd(int epoll_fd, int fd, uint32_t source) {
+  struct epoll_event event = { .events = EPOLLIN, .data.u32 = source };
+
+  if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+    fprintf(stderr, "epoll_ctl() failed for fd %d: %d: %s\n", fd, errno, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+// Arm timerfd to fire once at an absolute CLOCK_MONOTONIC time.
+static void arm_timer(int timer_fd, struct timespec *target) {
+  struct itimerspec timer = { .it_interval = {0, 0}, .it_value = *target };
+  timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &timer, NULL);
+}
+
+// Track the mouse driver init sequence from modem line edges, ident once the PC raises RTS again.
+static void handle_pc_init(serial_port_t *port, mouse_state_t *mouse, struct opts *options, modem_edge_t *edge) {
+  struct timespec time_now, time_diff;
+  uint32_t delay;
+
+  if((edge->lines & (TIOCM_CTS | TIOCM_DSR)) == 0) { // Computers RTS & DTR low
+    if(options->debug && mouse->pc_state != CTS_LOW_INIT) {
+      aprint("Computers RTS & DTR pins set low, waiting for RTS to identify as mouse.");
+    }
+    mouse->pc_state = CTS_LOW_INIT; // Also where we stay while the PC is powered off.
+  }
+  else if((edge->lines & TIOCM_CTS) && mouse->pc_state == CTS_LOW_INIT) {
+    mouse->pc_state = CTS_TOGGLED;
+    serial_discard(port); // Half sent packets would only confuse the driver, and the queue is out of the way at once
+    if(port->baud != 1200) { serial_set_baud(port, 1200, &delay); } // Driver starts over at 1200 baud.
+    mouse_ident(port, options->protocol, options->wheel, options->immediate);
+    mouse->mmb_sent = 0; // New driver session starts with the middle button up
+
+    if(options->debug) {
+      clock_gettime(CLOCK_MONOTONIC, &time_now);
+      timespec_diff(&time_now, &edge->time, &time_diff);
+      fprintf(stderr, "Ident sent %ldus after RTS edge\n", (time_diff.tv_sec * NS_FULL_SECOND + time_diff.tv_nsec) / 1000);
+    }
+    aprint("Mouse initialized. Good to go!");
+  }
+}
+
+
+/*** Bindings ***/
+
+// Current time of a binding, simulated while replaying as fast as possible.
+static void binding_clock(binding_t *binding, struct timespec *now) {
+  if(binding->options.replaypath != NULL && binding->options.replay_fast) { *now = binding->clock; }
+  else { clock_gettime(CLOCK_MONOTONIC, now); }
+}
+
+static int time_reached(struct timespec *target, struct timespec *now) {
+  struct timespec time_diff;
+
+  timespec_diff(target, now, &time_diff);
+  return time_diff.tv_sec < 0 || (time_diff.tv_sec == 0 && time_diff.tv_nsec == 0);
+}
+
+// Account for a packet just written
+static void binding_sent(binding_t *binding) {
+  struct timespec time_now, time_diff;
+
+  binding_clock(binding, &time_now);
+  if(binding->window_open) {
+    timespec_diff(&time_now, &binding->window_start, &time_diff);
+    hist_record(&binding->latency, time_diff.tv_sec < 0 ? 0 : timespec_ns(&time_diff) / 1000);
+  }
+  binding->window_open = binding->mouse.update > -1; // Carried motion is still from the same events
+  if(binding->options.drain) { drain_watch_written(&binding->drain, &time_now); }
+}
+
+// How late the transmit timer woke us up
+static void binding_wakeup(binding_t *binding) {
+  struct timespec time_now, time_diff;
+  uint64_t late;
+
+  clock_gettime(CLOCK_MONOTONIC, &time_now);
+  timespec_diff(&time_now, &binding->timer_target, &time_diff);
+  late = time_diff.tv_sec < 0 ? 0 : timespec_ns(&time_diff);
+  hist_record(&binding->wakeup_latency, late / 1000);
+  if(late > (uint64_t)binding->port.char_time) { binding->overruns++; }
+}
+
+static void binding_print_latency(binding_t *binding) {
+  hist_print(&binding->latency);
+  if(binding->options.drain) { hist_print(&binding->drain_latency); }
+  hist_print(&binding->wakeup_latency);
+  printf("Overruns: %lu wake ups late by more than a character, line went idle\n", binding->overruns);
+}
+
+// Send mouse state updates clamped to baud max rate
+static void binding_transmit(binding_t *binding) {
+  mouse_state_t *mouse = &binding->mouse;
+  struct timespec time_now, time_diff;
+  uint32_t delay;
+
+  if(binding->port.baud_next) { return; } // Nothing goes out until the line has switched speed
+  if(binding->port.pending_size > 0) { return; } // Keep aggregating, EPOLLOUT finishes the last packet first
+
+  if(mouse->update > -1 || mouse->force_update) {
+    binding_clock(binding, &time_now);
+
+    if(time_reached(&binding->time_target, &time_now) && !mouse->force_update &&
+       !serial_line_ready(&binding->port, &delay)) {
+      binding->time_target = timespec_after(&time_now, delay); // Line is slower than it should be, check again later
+    }
+    else if(time_reached(&binding->time_target, &time_now) || mouse->force_update) {
+      if(binding->options.debug) {
+        timespec_diff(&binding->time_target, &time_now, &time_diff);
+        fprintf(stderr, "Time: %d.%d\n", (int)time_diff.tv_sec, (int)time_diff.tv_nsec);
+      }
+      // Use variable send rate depending on packet length (3 or 4 byte updates) and line speed
+      binding->time_target = timespec_after(&time_now,
+                                            packet_time(&binding->port, mouse_send(&binding->port, mouse, &binding->options)));
+      binding_sent(binding);
+    }
+    if((mouse->update > -1) && !binding->timer_armed && !binding->options.replay_fast) { // Wake up exactly when the line is free again.
+      arm_timer(binding->timer_fd, &binding->time_target);
+      binding->timer_target = binding->time_target;
+      binding->timer_armed = 1;
+    }
+  }
+}
+
+// Switch line speed once what's queued at the old speed is out, the transmit timer retries until then.
+static void binding_set_baud(binding_t *binding, int baud) {
+  uint32_t delay;
+
+  switch(serial_set_baud(&binding->port, baud, &delay)) {
+    case 0:
+      if(binding->options.debug) { fprintf(stderr, "PC requested switch to %d baud\n", baud); }
+      break;
+    case 1:
+      binding->time_target = get_target_time(delay);
+      arm_timer(binding->timer_fd, &binding->time_target);
+      binding->timer_target = binding->time_target;
+      binding->timer_armed = 1;
+      break;
+  }
+}
+
+// Follow the transmitter, epoll only has to wake us for room in the tty buffer while a packet is half written.
+static void binding_watch_output(binding_t *binding, int epoll_fd, int index) {
+  int pending = binding->port.pending_size > 0;
+  struct epoll_event event = { .events = EPOLLIN | (pending ? EPOLLOUT : 0),
+                               .data.u32 = EVENT_TAG(EVENT_SERIAL, index, 0) };
+
+  if(pending != binding->watch_output) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, binding->port.fd, &event);
+    binding->watch_output = pending;
+  }
+}
+
+// Read ahead the next replayed event, marks the replay done at the end.
+static void replay_next(binding_t *binding) {
+  int returncode = record_read(&binding->replay, &binding->replay_source, &binding->replay_ev);
+
+  if(returncode < 0) { fprintf(stderr, "Recording %s is cut short.\n", binding->options.replaypath); }
+  if(returncode <= 0) { binding->replay_done = 1; }
+}
+
+static struct timespec replay_due(binding_t *binding) {
+  struct timeval *time = &binding->replay_ev.time;
+  return timespec_after(&binding->replay_start, time->tv_sec * NS_FULL_SECOND + time->tv_usec * 1000L);
+}
+
+// Send whatever the simulated line would have had time for before target.
+static void replay_advance(binding_t *binding, struct timespec *target) {
+  while(binding->mouse.update > -1 && binding->port.pending_size == 0 && time_reached(&binding->time_target, target)) {
+    binding->clock = binding->time_target;
+    binding_transmit(binding);
+  }
+  binding->clock = *target;
+}
+
+// Feed due replayed events into the mouse state, the same way events from a mouse would be.
+static void replay_events(binding_t *binding) {
+  struct timespec time_now, due;
+  struct timespec soon = { 0, 1 }; // Already passed, fires right away
+  mouse_source_t *source;
+  int count = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &time_now);
+  while(!binding->replay_done) {
+    due = replay_due(binding);
+    if(binding->options.replay_fast) {
+      if(count++ >= REPLAY_FAST_BATCH) { break; } // Let the rest of the loop run now and then
+      replay_advance(binding, &due);
+    }
+    else if(!time_reached(&due, &time_now)) { break; }
+
+    source = &binding->input.sources[binding->replay_source % MAX_MOUSE_SOURCES];
+    process_mouse_event(&binding->mouse, &binding->options, &binding->accel, &binding->input, source, &binding->replay_ev);
+    binding_event_time(binding, &due);
+    if(binding->options.replay_fast && binding->replay_ev.type == EV_SYN) {
+      binding_transmit(binding); // Where a real mouse would have woken the loop up
+    }
+    replay_next(binding);
+  }
+
+  if(binding->replay_done) {
+    if(binding->options.replay_fast) { replay_advance(binding, &binding->time_target); } // Flush what's left
+  }
+  else {
+    arm_timer(binding->replay_fd, binding->options.replay_fast ? &soon : &due);
+  }
+}
+
+// Replay is over and everything it produced has been sent.
+static int binding_finished(binding_t *binding) {
+  return binding->options.replaypath != NULL && binding->replay_done &&
+         binding->mouse.update == -1 && !binding->mouse.force_update && binding->port.pending_size == 0;
+}
+
+// Open mice and serial port of a binding and register them with the shared event loop.
+static int binding_open(binding_t *binding, int epoll_fd, int index) {
+  struct opts *options = &binding->options;
+  serial_port_t *port = &binding->port;
+  int notify_fd = -1;
+  int i;
+
+  accel_init(&binding->accel, options->sensitivity, options->accel_curve, options->accel_rate, options->accel_limit);
+  hist_init(&binding->latency, "Latency event to write (us)");
+  hist_init(&binding->drain_latency, "Latency write to drained (us)");
+  hist_init(&binding->wakeup_latency, "Timer wake up jitter (us)");
+
+  /*** USB mouse device input ***/
+  if(options->replaypath != NULL) { // Recording stands in for the mice, each recorded device gets a slot
+    if(record_open(&binding->replay, options->replaypath, 0) < 0) { return -1; }
+    binding->input.count = MAX_MOUSE_SOURCES;
+    for(i=0; i < MAX_MOUSE_SOURCES; i++) { binding->input.sources[i].fd = -1; }
+    binding->input.notify_fd = -1;
+    binding->mice_open = 1;
+  }
+  else {
+    binding->mice_open = input_open(&binding->input, options->mousepaths, options->mousepath_count, options->exclusive);
+    notify_fd = input_hotplug_start(&binding->input); // Mice can come back without the PC reloading its driver
+    if(binding->mice_open == 0) {
+      if(notify_fd < 0) {
+        fprintf(stderr, "No usable mouse device found for %s.\n", options->serialpath);
+        input_close(&binding->input);
+        return -1;
+      }
+      fprintf(stderr, "No usable mouse device found for %s yet, waiting for one to be plugged in.\n", options->serialpath);
+    }
+    if(options->recordpath != NULL && record_open(&binding->record, options->recordpath, 1) < 0) {
+      input_close(&binding->input);
+      return -1;
+    }
   }
 
   /*** Serial device ***/
-  int fd;
-  fd = open(options->serialpath, O_RDWR | O_NOCTTY | O_NONBLOCK); 
-  if(fd < 0) {
-    fprintf(stderr, "Serial device file open() failed: %d: %s\n", errno, strerror(errno));
-    exit(-1);
+  port->baud = 1200;
+  port->fd = open(options->serialpath, O_RDWR | O_NOCTTY | O_NONBLOCK); 
+  if(port->fd < 0) {
+    fprintf(stderr, "Serial device file %s open() failed: %d: %s\n", options->serialpath, errno, strerror(errno));
+    input_close(&binding->input);
+    return -1;
   }
   else {
-    fcntl(fd, F_SETFL, 0); // Reset flags on serial fd, should maybe F_GETFL instead and mod state.
+    fcntl(port->fd, F_SETFL, O_NONBLOCK); // Reset flags on serial fd, keep writes from stalling the event loop.
   }
 
-  if (tcgetattr(fd, &old_tty) != 0) {
+  if (tcgetattr(port->fd, &binding->old_tty) != 0) {
     fprintf(stderr, "tcgetattr() failed: %d: %s\n", errno, strerror(errno));
   }
  
   // Initialize serial parameters 
-  setup_tty(fd, (speed_t)B1200);
-  enable_pin(fd, TIOCM_RTS | TIOCM_DTR);
+  setup_tty(port->fd, baud_to_speed(port->baud), protocol_data_bits(options->protocol));
+  enable_pin(port->fd, TIOCM_RTS | TIOCM_DTR);
+  port->char_time = serial_char_time(port->fd);
+  serial_pacing_init(port, options->pacing);
+  binding->opened = 1;
 
-  fcntl (0, F_SETFL, O_NONBLOCK); // Nonblock 0=stdin
-  
-  // Aggregate movements before sending
-  struct timespec time_now, time_target, time_diff;
-  uint8_t init_mouse_state[] = "\x40\x00\x00\x00"; // Our basic mouse packet (We send 3 or 4 bytes of it)
-  mouse_state_t mouse;
-  memcpy( mouse.state, init_mouse_state, sizeof(mouse.state) ); // Set packet memory to initial state
+  if(options->drain && drain_watch_start(&binding->drain, port->fd, &binding->drain_latency) < 0) { return -1; }
 
-  int movement;
-  int i; // Allocate outside main loop instead of allocating every time.
+  // Transmit pacing timer
+  binding->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if(binding->timer_fd < 0) {
+    fprintf(stderr, "timerfd_create() failed: %d: %s\n", errno, strerror(errno));
+    return -1;
+  }
 
-  time_target = get_target_time(SERIALDELAY_3B);
-  
-  printf("%s\n\n", title);
-  aprint("Waiting for PC to initialize mouse driver..");
+  for(i=0; i < binding->input.count; i++) {
+    if(binding->input.sources[i].fd < 0) { continue; }
+    if(watch_fd(epoll_fd, binding->input.sources[i].fd, EVENT_TAG(EVENT_MOUSE, index, i)) < 0) { return -1; }
+    if(options->debug) { fprintf(stderr, "Reading mouse %s\n", binding->input.sources[i].path); }
+  }
+  if(watch_fd(epoll_fd, port->fd,          EVENT_TAG(EVENT_SERIAL, index, 0))  < 0 ||
+     watch_fd(epoll_fd, binding->timer_fd, EVENT_TAG(EVENT_TXTIMER, index, 0)) < 0) {
+    return -1;
+  }
+  if(notify_fd >= 0 && watch_fd(epoll_fd, notify_fd, EVENT_TAG(EVENT_HOTPLUG, index, 0)) < 0) { return -1; }
+  if(options->replaypath != NULL) {
+    binding->replay_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if(binding->replay_fd < 0 || watch_fd(epoll_fd, binding->replay_fd, EVENT_TAG(EVENT_REPLAY, index, 0)) < 0) {
+      fprintf(stderr, "Replay timer setup failed: %d: %s\n", errno, strerror(errno));
+      return -1;
+    }
+  }
+
+  // Driver init is signalled only through modem lines which epoll can't see, a helper thread waits on them.
+  if(!options->immediate) {
+    int modem_fd = modem_watch_start(&binding->modem_watch, port->fd, TIOCM_CTS | TIOCM_DSR);
+    if(modem_fd < 0 || watch_fd(epoll_fd, modem_fd, EVENT_TAG(EVENT_MODEM, index, 0)) < 0) { return -1; }
+  }
+
+  // Aggregate movements before sending
+  binding->mouse.pc_state = CTS_UNINIT;
+  reset_mouse_state(&binding->mouse);
+  binding->time_target = get_target_time(packet_time(port, 3));
 
   // Ident immediately on program start up.
   if(options->immediate) {
     aprint("Performing immediate identification as mouse.");
-    mouse_ident(fd, options->wheel, options->immediate);
+    mouse_ident(port, options->protocol, options->wheel, options->immediate);
   }
 
+  // Replay starts right away, use -i so the driver is ready for it.
+  if(options->replaypath != NULL) {
+    clock_gettime(CLOCK_MONOTONIC, &binding->replay_start);
+    binding->clock = binding->replay_start;
+    binding->time_target = binding->clock;
+    replay_next(binding);
+    replay_events(binding);
+    binding->touched = 1; // Might be empty and done already
+  }
+  return 0;
+}
 
-  /*** Main loop ***/
+// Handle one event of a binding. Returns -1 once the binding has no mice left and can't get new ones.
+static int binding_event(binding_t *binding, int epoll_fd, int index, struct epoll_event *event) {
+  int opened[MAX_MOUSE_SOURCES];
+  mouse_source_t *source;
+  modem_edge_t modem_edge;
+  uint64_t expirations;
+  int returncode;
+  int count;
+  int baud;
 
-  while(1) {
-    mouse.update = -1;
+  binding->touched = 1;
+  switch(EVENT_TYPE(event->data.u32)) {
+    case EVENT_MOUSE:
+      source = &binding->input.sources[EVENT_INDEX(event->data.u32)];
+      returncode = read_mouse(binding, source);
+      if(returncode == 0 && (event->events & (EPOLLERR | EPOLLHUP))) { returncode = -ENODEV; }
+      if(returncode < 0) {
+        fprintf(stderr, "Reading mouse %s failed: %d: %s\n", source->path, -returncode, strerror(-returncode));
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, source->fd, NULL);
+        input_close_source(&binding->input, source);
+        sync_buttons(&binding->mouse, &binding->input);
+        if(--binding->mice_open == 0) {
+          if(binding->input.notify_fd < 0) { return -1; }
+          fprintf(stderr, "No mice left for %s, waiting for one to be plugged in.\n", binding->options.serialpath);
+        }
+      }
+      break;
 
-    /* Check if mouse driver trying to initialize */
-    /* TODO: This will also trigger if the PC is not powered */
-    if((get_pin(fd, TIOCM_CTS | TIOCM_DSR) == 0) && (!options->immediate)) { // Computers RTS & DTR low
-      if(options->debug) {
-	aprint("Computers RTS & DTR pins set low, identifying as mouse.");
+    // Serial side and ident state are left alone, the PC never notices the mouse was gone.
+    case EVENT_HOTPLUG:
+      count = input_hotplug_read(&binding->input, opened);
+      for(int i=0; i < count; i++) {
+        source = &binding->input.sources[opened[i]];
+        if(watch_fd(epoll_fd, source->fd, EVENT_TAG(EVENT_MOUSE, index, opened[i])) < 0) {
+          input_close_source(&binding->input, source);
+          continue;
+        }
+        binding->mice_open++;
+        fprintf(stderr, "Mouse %s attached to %s\n", source->path, binding->options.serialpath);
+        read_mouse(binding, source); // Don't wait for epoll on queued events
       }
+      break;
 
-      mouse_ident(fd, options->wheel, options->immediate);
-      aprint("Mouse initialized. Good to go!");
+    case EVENT_SERIAL:
+      if(event->events & EPOLLOUT) {
+        serial_write_pending(&binding->port);
+        if(binding->options.replay_fast && binding->replay_done) { replay_advance(binding, &binding->time_target); } // Held back
+      }
+      baud = handle_serial_input(&binding->port);
+      if(baud && baud != binding->port.baud) { binding_set_baud(binding, baud); }
+      break;
 
-      /* Negotiate 2400 baud rate 
-       *
-       * Microsoft protocols may be limited to only 1200 baud.
-       *
-       * */
-      //setup_tty(fd, (speed_t)B1200);
+    case EVENT_TXTIMER:
+      read(binding->timer_fd, &expirations, sizeof(expirations));
+      binding->timer_armed = 0;
+      binding_wakeup(binding);
+      if(binding->port.baud_next) { binding_set_baud(binding, binding->port.baud_next); }
+      break;
 
-      /* setup_tty(fd, &tty, (speed_t)B2400);*/
-      //serial_write(fd, "*o", 2); 
-      //usleep(100);
-    }
+    case EVENT_REPLAY:
+      read(binding->replay_fd, &expirations, sizeof(expirations));
+      replay_events(binding);
+      break;
 
-    if (libevdev_next_event(mouse_dev, LIBEVDEV_READ_FLAG_NORMAL, &ev) == LIBEVDEV_READ_STATUS_SUCCESS) {
-
-      /** Handle mouse buttons ***/
-      if(ev.type == EV_KEY) {
-	switch(ev.code) {
-	  case BTN_LEFT:
-	    mouse.lmb = ev.value;
-	    mouse.force_update = 1;
-	    push_update(&mouse, mouse.mmb);
-	    break;
-	  case BTN_RIGHT:
-	    mouse.rmb = ev.value;
-	    mouse.force_update = 1;
-	    push_update(&mouse, mouse.mmb);
-	    break;
-	  case BTN_MIDDLE:
-	    if(options->wheel) {
-  	      mouse.mmb = ev.value;
-	      mouse.force_update = 1;
-	      push_update(&mouse, 1); // Every time MMB changes (on or off), must send 4 bytes.
-	    }
-	    break;
-        }
+    case EVENT_MODEM:
+      if(modem_watch_read(&binding->modem_watch, &modem_edge) == 0) {
+        handle_pc_init(&binding->port, &binding->mouse, &binding->options, &modem_edge);
       }
-      
-      /*** Handle relative movement ***/
-      else if (ev.type == EV_REL) {
-	switch(ev.code) {
-	  case REL_X:
-	    mouse.x += ev.value;
-            mouse.x = clamp(mouse.x, -127, 127);
-	    break;
-          case REL_Y:
- 	    mouse.y += ev.value;
-            mouse.y = clamp(mouse.y, -127, 127);
-	    break;
-	  case REL_WHEEL:
-	    if(options->wheel) {
-	      mouse.wheel += ev.value;
-              mouse.wheel = clamp(mouse.wheel, -15, 15);
-	      push_update(&mouse, 1);
-	    }
-	    break;
-	}
-	push_update(&mouse, mouse.mmb);
+      break;
+  }
+  return 0;
+}
+
+// Print stats and give the devices back the way we found them.
+static void binding_close(binding_t *binding, int epoll_fd, int bindings_count) {
+  if(!binding->opened) { return; }
+
+  if(bindings_count > 1) { printf("%s:\n", binding->options.serialpath); }
+  print_serial_stats(&binding->port.stats);
+  printf("Motion: %u counts carried to later packets, %u dropped over backlog limit\n",
+         binding->mouse.motion_carried, binding->mouse.motion_dropped);
+  binding_print_latency(binding);
+
+  // Helper threads go first, they must not be left using the port fd once it's closed and reused.
+  if(binding->modem_watch.running) { epoll_ctl(epoll_fd, EPOLL_CTL_DEL, binding->modem_watch.pipe_fd[0], NULL); }
+  modem_watch_stop(&binding->modem_watch);
+  drain_watch_stop(&binding->drain);
+
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, binding->port.fd, NULL);
+  disable_pin(binding->port.fd, TIOCM_RTS | TIOCM_DTR);
+  tcsetattr(binding->port.fd, TCSANOW, &binding->old_tty);
+
+  input_close(&binding->input); // Also releases exclusive mouse access
+  close(binding->port.fd);
+  if(binding->timer_fd > 0) { close(binding->timer_fd); }
+  if(binding->replay_fd > 0) { close(binding->replay_fd); }
+  record_close(&binding->record);
+  record_close(&binding->replay);
+  binding->opened = 0;
+}
+
+
+/*** Main init & loop ***/
+
+int main(int argc, char **argv) {
+  int bindings_count = 0;
+  int bindings_open = 0;
+  int i, j;
+
+  // Parse commandline options
+  if(argc < 2) { showhelp(argv); exit(0); }
+  binding_t *bindings = (binding_t*) calloc(MAX_BINDINGS, sizeof(binding_t)); // Memory is zeroed by calloc
+  if (bindings == NULL) {
+    fprintf(stderr, "Failed calloc() for bindings: %d: %s\n", errno, strerror(errno));
+    exit(-1);
+  }
+
+  struct opts options = {0};
+  default_opts(&options);
+  if(parse_opts(argc, argv, &options) != 0) { exit(0); }
+
+  // Commandline describes a binding of its own unless it only sets defaults for a config file.
+  if(options.configpath == NULL || options.mousepath_count > 0 || options.serialpath != NULL) {
+    if(check_opts(&options) != 0) { exit(0); }
+    bindings[bindings_count++].options = options;
+  }
+  if(options.configpath != NULL) {
+    bindings_count = parse_config(&options, bindings, bindings_count);
+    if(bindings_count < 0) { exit(0); }
+    if(bindings_count == 0) {
+      fprintf(stderr, "No bindings found in %s\n", options.configpath);
+      exit(0);
+    }
+  }
+  for(i=0; i < bindings_count; i++) {
+    for(j=0; j < i; j++) {
+      if(strcmp(bindings[i].options.serialpath, bindings[j].options.serialpath) == 0) {
+        fprintf(stderr, "Serial port %s is used by more than one binding.\n", bindings[i].options.serialpath);
+        exit(0);
       }
+    }
+  }
 
-      /*** Send mouse state updates clamped to baud max rate ***/ 
-      clock_gettime(CLOCK_MONOTONIC, &time_now);
-      timespec_diff(&time_target, &time_now, &time_diff);
-
-      if((time_diff.tv_sec < 0 && mouse.update > -1) || mouse.force_update) {
-
-        // Set mouse button states	
-	mouse.state[0] |= (mouse.lmb << MOUSE_LMB_BIT);
-	mouse.state[0] |= (mouse.rmb << MOUSE_RMB_BIT);
-	mouse.state[3] |= (mouse.mmb << MOUSE_MMB_BIT);
-
-	// Update aggregated mouse movement state
-        movement = mouse.x & 0xc0; // Get 2 upper bits of X movement
-	mouse.state[0] = mouse.state[0] | (movement >> 6); // Sets bit based on ev.value, 8th bit to 2nd bit (Discards bits)
-	mouse.state[1] = mouse.state[1] | (mouse.x & 0x3f); 
-
-        movement = mouse.y & 0xc0; // Get 2 upper bits of Y movement
-	mouse.state[0] = mouse.state[0] | (movement >> 4);
-	mouse.state[2] = mouse.state[2] | (mouse.y & 0x3f); 
-
-	mouse.state[3] = mouse.state[3] | (-mouse.wheel & 0x0f); // 127(negatives) when scrolling up, 1(positives) when scrolling down.
-
-	// Send updates
-        for(i=0; i <= mouse.update; i++) {
-          if(options->debug) {
-	    fprintf(stderr, "Time: %d.%d\n", (int)time_diff.tv_sec, (int)time_diff.tv_nsec);
-            fprintf(stderr, "Sent(ev:%d) %d: %x\n", ev.code, i, mouse.state[i]);
-	    fprintf(stderr, "Mouse state(%d): %s\n", i, byte_to_bitstring(mouse.state[i]));
-	  }
-          write(fd, &mouse.state[i], sizeof(uint8_t));
+  fcntl (0, F_SETFL, O_NONBLOCK); // Nonblock 0=stdin
+
+  // Before opening anything, helper threads started later inherit it. Memory is locked once they exist.
+  if(options.rt_priority > 0 || options.cpu >= 0) {
+    if(realtime_setup(options.rt_priority, options.cpu) == 0 && options.rt_priority > 0) {
+      aprint("Running in real-time mode.");
+    }
+  }
+
+  /*** Event sources ***/
+
+  // Deliver termination signals through the event loop so we get to clean up.
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGUSR1); // Print latency histograms
+  sigprocmask(SIG_BLOCK, &signals, NULL);
+  int signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+
+  // All bindings share one event loop, an idle binding costs nothing.
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if(signal_fd < 0 || epoll_fd < 0) {
+    fprintf(stderr, "Event source setup failed: %d: %s\n", errno, strerror(errno));
+    exit(-1);
+  }
+  if(watch_fd(epoll_fd, signal_fd, EVENT_TAG(EVENT_SIGNAL, 0, 0)) < 0) { exit(-1); }
+
+  printf("%s\n\n", title);
+
+  for(i=0; i < bindings_count; i++) {
+    if(binding_open(&bindings[i], epoll_fd, i) < 0) {
+      for(j=0; j <= i; j++) { binding_close(&bindings[j], epoll_fd, bindings_count); }
+      exit(-1);
+    }
+    bindings_open++;
+  }
+  if(options.rt_priority > 0) { realtime_lock_memory(); }
+  aprint("Waiting for PC to initialize mouse driver..");
+
+  struct epoll_event events[MAX_EVENTS];
+  struct signalfd_siginfo siginfo;
+  binding_t *binding;
+  int running = 1;
+  int nfds;
+
+
+  /*** Main loop ***/
+
+  while(running) {
+    nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, -1); // Sleep until something happens
+    if(nfds < 0) {
+      if(errno == EINTR) { continue; }
+      fprintf(stderr, "epoll_wait() failed: %d: %s\n", errno, strerror(errno));
+      break;
+    }
+
+    for(i=0; i < nfds; i++) {
+      if(EVENT_TYPE(events[i].data.u32) == EVENT_SIGNAL) {
+        while(read(signal_fd, &siginfo, sizeof(siginfo)) == sizeof(siginfo)) {
+          if(siginfo.ssi_signo != SIGUSR1) {
+            running = 0;
+            continue;
+          }
+          for(j=0; j < bindings_count; j++) {
+            if(!bindings[j].opened) { continue; }
+            if(bindings_count > 1) { printf("%s:\n", bindings[j].options.serialpath); }
+            binding_print_latency(&bindings[j]);
+          }
+          fflush(stdout);
         }
-	if(options->debug) { printf("\n"); }
+        continue;
+      }
 
-	// Use variable send rate depending on whether middle mouse button pressed or not (3 or 4 byte updates)
-	if(mouse.mmb) { time_target = get_target_time(SERIALDELAY_4B); }
-	else          { time_target = get_target_time(SERIALDELAY_3B); }
-        mouse.update = -1;
-	mouse.force_update = 0;
-	mouse.x = mouse.y = mouse.wheel = 0;
+      binding = &bindings[EVENT_BINDING(events[i].data.u32)];
+      if(!binding->opened) { continue; } // Closed earlier in this batch
 
-        memcpy( mouse.state, init_mouse_state, sizeof(mouse.state) ); // Reset packet to initial state
+      if(binding_event(binding, epoll_fd, EVENT_BINDING(events[i].data.u32), &events[i]) < 0) {
+        binding_close(binding, epoll_fd, bindings_count);
+        if(--bindings_open == 0) { running = 0; }
       }
- 
-      usleep(1);
     }
-  }
 
-  disable_pin(fd, TIOCM_RTS | TIOCM_DTR);
+    // Only bindings that saw events can have anything to send
+    for(i=0; i < bindings_count; i++) {
+      if(bindings[i].touched && bindings[i].opened) {
+        binding_transmit(&bindings[i]);
+        binding_watch_output(&bindings[i], epoll_fd, i);
+        if(binding_finished(&bindings[i])) {
+          binding_close(&bindings[i], epoll_fd, bindings_count);
+          if(--bindings_open == 0) { running = 0; }
+        }
+      }
+      bindings[i].touched = 0;
+    }
+  }
 
-  if(options->exclusive) { ioctl(fd, EVIOCGRAB, 0); } // Release exclusive mouse access
-  close(fd);
+  for(i=0; i < bindings_count; i++) {
+    binding_close(&bindings[i], epoll_fd, bindings_count);
+  }
+  close(epoll_fd);
+  close(signal_fd);
 
-  free(options);
+  free(bindings);
 
   return(0);
 }
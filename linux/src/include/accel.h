@@ -0,0 +1,45 @@
+/* 
+ * Anachro Mouse, a usb to serial mouse adaptor. Copyright (C) 2021 Aviancer <oss+amouse@skyvian.me>
+ *
+ * This library is free software; you can redistribute it and/or modify it under the terms of the 
+ * GNU Lesser General Public License as published by the Free Software Foundation; either version 
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without 
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the 
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along with this library; 
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef ACCEL_H_   /* Include guard */
+#define ACCEL_H_
+
+#include <stdint.h>
+
+/* Sensitivity and acceleration in fixed point, gain 1.0 is ACCEL_ONE.
+ * Gains are looked up by speed (counts per report), so scaling a report costs a couple of multiplies. */
+#define ACCEL_FRAC_BITS 8
+#define ACCEL_ONE (1 << ACCEL_FRAC_BITS)
+#define ACCEL_LUT_SIZE 64 // Faster reports use the last gain
+
+// Acceleration curves, gain as a function of speed
+enum ACCEL_CURVES {
+  ACCEL_FLAT      = 0, // Sensitivity only
+  ACCEL_LINEAR    = 1, // Gain grows by rate% per count of speed, up to limit%
+  ACCEL_QUADRATIC = 2  // Gain grows with speed squared, gentle for small movements
+};
+
+typedef struct accel {
+  uint32_t gain[ACCEL_LUT_SIZE];
+  int32_t remainder_x, remainder_y; // Fraction of a count left over, carried into the next report
+} accel_t;
+
+int accel_curve(const char *name);
+
+void accel_init(accel_t *accel, int sensitivity, int curve, int rate, int limit);
+
+void accel_apply(accel_t *accel, int *x, int *y);
+
+#endif // ACCEL_H_
@@ -0,0 +1,82 @@
+/* 
+ * Anachro Mouse, a usb to serial mouse adaptor. Copyright (C) 2021 Aviancer <oss+amouse@skyvian.me>
+ *
+ * This library is free software; you can redistribute it and/or modify it under the terms of the 
+ * GNU Lesser General Public License as published by the Free Software Foundation; either version 
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without 
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the 
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along with this library; 
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include <stdio.h>    // Standard input / output
+
+#include "histogram.h"
+
+static int hist_bucket(uint64_t value) {
+  if(value < HIST_SUB_BUCKETS) { return value; }
+
+  int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS; // Keep the top HIST_SUB_BITS+1 bits
+  return (shift + 1) * HIST_SUB_BUCKETS + (int)((value >> shift) - HIST_SUB_BUCKETS);
+}
+
+// Largest value that lands in a bucket
+static uint64_t hist_bucket_value(int bucket) {
+  if(bucket < HIST_SUB_BUCKETS) { return bucket; }
+
+  int shift = bucket / HIST_SUB_BUCKETS - 1;
+  uint64_t mantissa = HIST_SUB_BUCKETS + bucket % HIST_SUB_BUCKETS;
+  return ((mantissa + 1) << shift) - 1;
+}
+
+void hist_init(histogram_t *hist, const char *name) {
+  hist->name = name;
+  for(int i=0; i < HIST_BUCKETS; i++) { atomic_init(&hist->counts[i], 0); }
+  atomic_init(&hist->total, 0);
+  atomic_init(&hist->max, 0);
+}
+
+// Safe to call from any thread, never blocks.
+void hist_record(histogram_t *hist, uint64_t value) {
+  uint64_t max = atomic_load_explicit(&hist->max, memory_order_relaxed);
+
+  atomic_fetch_add_explicit(&hist->counts[hist_bucket(value)], 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&hist->total, 1, memory_order_relaxed);
+  while(value > max && !atomic_compare_exchange_weak_explicit(&hist->max, &max, value, memory_order_relaxed,
+                                                              memory_order_relaxed)) {}
+}
+
+// Value below which percentile % of recorded values are, rounded up to the bucket.
+uint64_t hist_percentile(histogram_t *hist, double percentile) {
+  uint64_t total = atomic_load_explicit(&hist->total, memory_order_relaxed);
+  uint64_t wanted = total * percentile / 100.0;
+  uint64_t seen = 0;
+
+  if(wanted >= total && total > 0) { wanted = total - 1; }
+  for(int i=0; i < HIST_BUCKETS; i++) {
+    seen += atomic_load_explicit(&hist->counts[i], memory_order_relaxed);
+    if(seen > wanted) {
+      uint64_t max = atomic_load_explicit(&hist->max, memory_order_relaxed);
+      uint64_t value = hist_bucket_value(i);
+      return value < max ? value : max;
+    }
+  }
+  return 0;
+}
+
+void hist_print(histogram_t *hist) {
+  uint64_t total = atomic_load_explicit(&hist->total, memory_order_relaxed);
+
+  if(total == 0) {
+    printf("%s: no samples\n", hist->name);
+    return;
+  }
+  printf("%s: n=%llu p50=%llu p90=%llu p99=%llu p99.9=%llu max=%llu\n", hist->name, (unsigned long long)total,
+         (unsigned long long)hist_percentile(hist, 50), (unsigned long long)hist_percentile(hist, 90),
+         (unsigned long long)hist_percentile(hist, 99), (unsigned long long)hist_percentile(hist, 99.9),
+         (unsigned long long)atomic_load_explicit(&hist->max, memory_order_relaxed));
+}
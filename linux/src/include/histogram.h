@@ -0,0 +1,43 @@
+/* 
+ * Anachro Mouse, a usb to serial mouse adaptor. Copyright (C) 2021 Aviancer <oss+amouse@skyvian.me>
+ *
+ * This library is free software; you can redistribute it and/or modify it under the terms of the 
+ * GNU Lesser General Public License as published by the Free Software Foundation; either version 
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without 
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the 
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along with this library; 
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef HISTOGRAM_H_   /* Include guard */
+#define HISTOGRAM_H_
+
+#include <stdint.h>     // for uint64_t
+#include <stdatomic.h>  // Recording from several threads without locks
+
+/* Log-linear buckets like HdrHistogram: exact below HIST_SUB_BUCKETS, above that each power of two is split
+ * into HIST_SUB_BUCKETS, so any value is within ~6% of its bucket. */
+#define HIST_SUB_BITS    4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS     ((64 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+typedef struct histogram {
+  const char *name;
+  atomic_uint_least32_t counts[HIST_BUCKETS];
+  atomic_uint_least64_t total;
+  atomic_uint_least64_t max;
+} histogram_t;
+
+void hist_init(histogram_t *hist, const char *name);
+
+void hist_record(histogram_t *hist, uint64_t value);
+
+uint64_t hist_percentile(histogram_t *hist, double percentile);
+
+void hist_print(histogram_t *hist);
+
+#endif // HISTOGRAM_H_
@@ -0,0 +1,289 @@
+/* 
+ * Anachro Mouse, a usb to serial mouse adaptor. Copyright (C) 2021 Aviancer <oss+amouse@skyvian.me>
+ *
+ * This library is free software; you can redistribute it and/or modify it under the terms of the 
+ * GNU Lesser General Public License as published by the Free Software Foundation; either version 
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without 
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the 
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along with this library; 
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include <stdio.h>    // Standard input / output
+#include <stdlib.h>   // Standard input / output
+#include <fcntl.h>    // File control defs, open()
+#include <unistd.h>   // UNIX standard function defs, close()
+#include <errno.h>    // Error number definitions
+#include <string.h>   // strerror()
+#include <time.h>     // CLOCK_MONOTONIC
+#include <glob.h>     // glob(), multiple devices from one -m
+#include <libgen.h>   // dirname()
+
+#include <sys/ioctl.h>   // ioctl (mouse exclusive access)
+#include <sys/stat.h>    // stat(), telling devices apart
+#include <sys/inotify.h> // inotify, hotplug
+
+#include "input.h"
+
+/*** USB comms ***/
+
+int open_usbinput(const char* device, int exclusive) {
+  int fd;
+  int returncode = 1;
+  struct libevdev* dev;
+
+  fd = open(device, O_RDONLY | O_NONBLOCK);
+  if (fd < 0) { return -1; }
+
+  /* Check if it's a mouse */
+  returncode = libevdev_new_from_fd(fd, &dev);
+  if (returncode < 0) {
+    fprintf(stderr, "Error: %d %s\n", -returncode, strerror(-returncode));
+    close(fd);
+    return -1;
+  }
+  returncode = libevdev_has_event_type(dev, EV_REL) &&
+               libevdev_has_event_code(dev, EV_REL, REL_X) &&
+               libevdev_has_event_code(dev, EV_REL, REL_Y) &&
+               libevdev_has_event_code(dev, EV_KEY, BTN_LEFT) &&
+               libevdev_has_event_code(dev, EV_KEY, BTN_MIDDLE) &&
+               libevdev_has_event_code(dev, EV_KEY, BTN_RIGHT);
+  libevdev_free(dev);
+
+  if (returncode) { 
+    if(exclusive && ioctl(fd, EVIOCGRAB, 1) < 0 && errno == EBUSY) { // Get exclusive mouse access
+      close(fd); // Someone else has it grabbed, likely another binding.
+      errno = EBUSY;
+      return -1;
+    }
+    return fd;
+  }
+
+  close(fd);
+  return -1;
+}
+
+// Index of the device path leads to if it is already open, -1 if not and -2 if there's no such file.
+static int input_find_open(mouse_input_t *input, const char *path) {
+  struct stat st;
+
+  if(stat(path, &st) < 0) { return -2; }
+  for(int i=0; i < input->count; i++) {
+    if(input->sources[i].fd >= 0 && input->sources[i].node_dev == st.st_dev && input->sources[i].node_ino == st.st_ino) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static int same_id(struct input_id *a, struct input_id *b) {
+  return a->bustype == b->bustype && a->vendor == b->vendor && a->product == b->product;
+}
+
+/* Open a mouse into the slot it belongs to: the lost device it was before (same path or same id) or a new one.
+ * With lost_only set only devices coming back are taken. Returns slot index or -1. */
+static int input_attach(mouse_input_t *input, const char *path, int lost_only, int verbose) {
+  mouse_source_t *source = NULL;
+  struct libevdev *dev;
+  struct input_id id;
+  struct stat st;
+  int returncode;
+  int fd;
+
+  fd = open_usbinput(path, input->exclusive);
+  if(fd < 0) {
+    if(verbose) { fprintf(stderr, "Mouse device %s open() failed or not a mouse: %d: %s\n", path, errno, strerror(errno)); }
+    return -1;
+  }
+
+  returncode = libevdev_new_from_fd(fd, &dev);
+  if(returncode < 0) {
+    fprintf(stderr, "libedev_new failed: %d %s\n", -returncode, strerror(-returncode));
+    close(fd);
+    return -1;
+  }
+  clockid_t clock = libevdev_set_clock_id(dev, CLOCK_MONOTONIC) == 0 ? CLOCK_MONOTONIC : CLOCK_REALTIME; // Comparable to our timers
+  id.bustype = libevdev_get_id_bustype(dev);
+  id.vendor = libevdev_get_id_vendor(dev);
+  id.product = libevdev_get_id_product(dev);
+
+  // Prefer the slot of a lost device, first by path then by id
+  for(int i=0; i < input->count && source == NULL; i++) {
+    if(input->sources[i].fd < 0 && strcmp(input->sources[i].path, path) == 0) { source = &input->sources[i]; }
+  }
+  for(int i=0; i < input->count && source == NULL; i++) {
+    if(input->sources[i].fd < 0 && same_id(&input->sources[i].id, &id)) { source = &input->sources[i]; }
+  }
+  if(source == NULL && !lost_only) {
+    if(input->count < MAX_MOUSE_SOURCES) { source = &input->sources[input->count++]; }
+    else if(verbose) { fprintf(stderr, "Too many mouse devices, ignoring %s\n", path); }
+  }
+  if(source == NULL) {
+    libevdev_free(dev);
+    close(fd);
+    return -1;
+  }
+
+  if(source->path == NULL || strcmp(source->path, path) != 0) {
+    free(source->path);
+    source->path = strdup(path);
+  }
+  fstat(fd, &st);
+  source->fd = fd;
+  source->dev = dev;
+  source->node_dev = st.st_dev;
+  source->node_ino = st.st_ino;
+  source->id = id;
+  source->clock = clock;
+  source->buttons = 0;
+  source->syncing = 0;
+  return source - input->sources;
+}
+
+// Open every mouse matching the given paths or glob patterns, returns number of devices opened.
+int input_open(mouse_input_t *input, char **patterns, int pattern_count, int exclusive) {
+  glob_t paths;
+
+  input->exclusive = exclusive;
+  input->patterns = patterns;
+  input->pattern_count = pattern_count;
+  input->notify_fd = -1;
+  for(int i=0; i < pattern_count; i++) {
+    if(glob(patterns[i], GLOB_NOCHECK, NULL, &paths) != 0) { continue; }
+    for(size_t j=0; j < paths.gl_pathc; j++) {
+      if(input_find_open(input, paths.gl_pathv[j]) < 0) { input_attach(input, paths.gl_pathv[j], 0, 1); }
+    }
+    globfree(&paths);
+  }
+  return input->count;
+}
+
+// (Re)add watches on the directories mice can show up in. Harmless to repeat, by-id may only appear later.
+static void input_hotplug_watch(mouse_input_t *input) {
+  uint32_t mask = IN_CREATE | IN_ATTRIB | IN_MOVED_TO; // udev renames symlinks in place, fixes permissions after
+  char dir[4096];
+
+  inotify_add_watch(input->notify_fd, "/dev/input", mask);
+  for(int i=0; i < input->pattern_count; i++) {
+    strncpy(dir, input->patterns[i], sizeof(dir) - 1);
+    dir[sizeof(dir) - 1] = '\0';
+    inotify_add_watch(input->notify_fd, dirname(dir), mask);
+  }
+}
+
+// Start watching for mice being plugged in, returns fd to wait on or -1.
+int input_hotplug_start(mouse_input_t *input) {
+  input->notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if(input->notify_fd < 0) {
+    fprintf(stderr, "inotify_init1() failed: %d: %s\n", errno, strerror(errno));
+    return -1;
+  }
+  input_hotplug_watch(input);
+  return input->notify_fd;
+}
+
+/* Something changed under the watched directories, pick up lost mice coming back and new ones matching a glob.
+ * Slot indexes of newly opened devices are put in opened, returns how many. */
+int input_hotplug_read(mouse_input_t *input, int *opened) {
+  char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  glob_t paths;
+  int count = 0;
+  int lost = 0;
+  int index;
+
+  while(read(input->notify_fd, buffer, sizeof(buffer)) > 0) {} // Which file doesn't matter, rescan all.
+  input_hotplug_watch(input);
+
+  for(int i=0; i < input->pattern_count; i++) {
+    if(glob(input->patterns[i], 0, NULL, &paths) != 0) { continue; }
+    for(size_t j=0; j < paths.gl_pathc; j++) {
+      if(input_find_open(input, paths.gl_pathv[j]) != -1) { continue; }
+      if((index = input_attach(input, paths.gl_pathv[j], 0, 0)) >= 0) { opened[count++] = index; }
+    }
+    globfree(&paths);
+  }
+
+  // A lost mouse given by a fixed name may come back under another, look for it by id
+  for(int i=0; i < input->count; i++) {
+    if(input->sources[i].fd < 0) { lost++; }
+  }
+  if(lost && glob("/dev/input/event*", 0, NULL, &paths) == 0) {
+    for(size_t j=0; j < paths.gl_pathc && lost; j++) {
+      if(input_find_open(input, paths.gl_pathv[j]) != -1) { continue; }
+      if((index = input_attach(input, paths.gl_pathv[j], 1, 0)) >= 0) {
+        opened[count++] = index;
+        lost--;
+      }
+    }
+    globfree(&paths);
+  }
+  return count;
+}
+
+void input_close_source(mouse_input_t *input, mouse_source_t *source) {
+  if(source->fd < 0) { return; }
+
+  // Anything held on a device which went away is released.
+  for(int i=0; i < INPUT_BUTTON_COUNT; i++) {
+    if(source->buttons & (1 << i)) { input->held[i]--; }
+  }
+  source->buttons = 0;
+
+  if(input->exclusive) { ioctl(source->fd, EVIOCGRAB, 0); } // Release exclusive mouse access
+  libevdev_free(source->dev);
+  close(source->fd);
+  source->dev = NULL;
+  source->fd = -1;
+}
+
+void input_close(mouse_input_t *input) {
+  for(int i=0; i < input->count; i++) {
+    input_close_source(input, &input->sources[i]);
+    free(input->sources[i].path);
+    input->sources[i].path = NULL;
+  }
+  input->count = 0;
+  if(input->notify_fd >= 0) {
+    close(input->notify_fd);
+    input->notify_fd = -1;
+  }
+}
+
+/* Next pending event from a device, resyncing if the kernel buffer overflowed.
+ * Returns 1 when ev was filled in, 0 when nothing is pending and negative errno if reading failed. */
+int input_next_event(mouse_source_t *source, struct input_event *ev) {
+  int flag = source->syncing ? LIBEVDEV_READ_FLAG_SYNC : LIBEVDEV_READ_FLAG_NORMAL;
+  int returncode = libevdev_next_event(source->dev, flag, ev);
+
+  if(returncode == LIBEVDEV_READ_STATUS_SYNC) {
+    if(source->syncing) { return 1; } // Catch up event for state lost in the overflow
+    source->syncing = 1; // Got SYN_DROPPED, fetch what we missed.
+    return input_next_event(source, ev);
+  }
+  if(returncode == -EAGAIN && source->syncing) {
+    source->syncing = 0; // Caught up, back to normal events.
+    return input_next_event(source, ev);
+  }
+  if(returncode == LIBEVDEV_READ_STATUS_SUCCESS) { return 1; }
+  if(returncode == -EAGAIN) { return 0; }
+  return returncode;
+}
+
+// Update a button on one device, returns the state of that button merged across all devices.
+int input_button(mouse_input_t *input, mouse_source_t *source, int button, int value) {
+  int mask = 1 << button;
+
+  if(value && !(source->buttons & mask)) {
+    source->buttons |= mask;
+    input->held[button]++;
+  }
+  else if(!value && (source->buttons & mask)) {
+    source->buttons &= ~mask;
+    input->held[button]--;
+  }
+  return input->held[button] > 0;
+}
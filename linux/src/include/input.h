@@ -0,0 +1,73 @@
+/* 
+ * Anachro Mouse, a usb to serial mouse adaptor. Copyright (C) 2021 Aviancer <oss+amouse@skyvian.me>
+ *
+ * This library is free software; you can redistribute it and/or modify it under the terms of the 
+ * GNU Lesser General Public License as published by the Free Software Foundation; either version 
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without 
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the 
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along with this library; 
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef INPUT_H_   /* Include guard */
+#define INPUT_H_
+
+#include <libevdev.h>
+#include <sys/types.h> // dev_t, ino_t
+
+#define MAX_MOUSE_SOURCES 16 // Most evdev devices merged into one mouse
+
+// Buttons tracked per device
+enum INPUT_BUTTONS {
+  INPUT_LMB = 0,
+  INPUT_RMB = 1,
+  INPUT_MMB = 2,
+  INPUT_BUTTON_COUNT
+};
+
+// A single evdev device feeding the mouse
+typedef struct mouse_source {
+  char *path;
+  int fd;
+  struct libevdev *dev;
+  dev_t node_dev;     // Which file is open, to skip paths leading to an already open device
+  ino_t node_ino;
+  struct input_id id; // To recognise the same mouse coming back under another name
+  int clock;          // Clock event timestamps are from, CLOCK_MONOTONIC unless the kernel refused
+  int buttons; // Bitmask of buttons held down on this device
+  int syncing; // Catching up after kernel buffer overflow
+  int report_x, report_y; // Motion of the report being read, scaled as a whole at SYN_REPORT
+} mouse_source_t;
+
+// All devices merged into one mouse
+typedef struct mouse_input {
+  mouse_source_t sources[MAX_MOUSE_SOURCES];
+  int count;
+  int held[INPUT_BUTTON_COUNT]; // How many devices are holding each button down
+  int exclusive;
+  char **patterns; // Paths & globs, kept for picking up devices plugged in later
+  int pattern_count;
+  int notify_fd;   // inotify on directories devices show up in, -1 when not watching
+} mouse_input_t;
+
+int open_usbinput(const char* device, int exclusive);
+
+int input_open(mouse_input_t *input, char **patterns, int pattern_count, int exclusive);
+
+int input_hotplug_start(mouse_input_t *input);
+
+int input_hotplug_read(mouse_input_t *input, int *opened);
+
+void input_close_source(mouse_input_t *input, mouse_source_t *source);
+
+void input_close(mouse_input_t *input);
+
+int input_next_event(mouse_source_t *source, struct input_event *ev);
+
+int input_button(mouse_input_t *input, mouse_source_t *source, int button, int value);
+
+#endif // INPUT_H_
@@ -0,0 +1,70 @@
+/* 
+ * Anachro Mouse, a usb to serial mouse adaptor. Copyright (C) 2021 Aviancer <oss+amouse@skyvian.me>
+ *
+ * This library is free software; you can redistribute it and/or modify it under the terms of the 
+ * GNU Lesser General Public License as published by the Free Software Foundation; either version 
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without 
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the 
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along with this library; 
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#define _GNU_SOURCE   // CPU_SET & sched_setaffinity()
+#include <stdio.h>    // Standard input / output
+#include <errno.h>    // Error number definitions
+#include <string.h>   // strerror()
+#include <unistd.h>   // sysconf()
+#include <sched.h>    // SCHED_FIFO, CPU affinity
+#include <sys/mman.h> // mlockall()
+
+#include "realtime.h"
+
+static void prefault_stack(void) {
+  volatile char stack[RT_STACK_PREFAULT];
+  long page = sysconf(_SC_PAGESIZE);
+
+  for(long i=0; i < RT_STACK_PREFAULT; i += page) { stack[i] = 0; }
+  (void)stack[0]; // Volatile read, writes above can't be optimised out
+}
+
+/* Make the process hard to preempt: SCHED_FIFO at priority (0 to leave scheduling alone), pinned to cpu (-1 for any).
+ * Threads started afterwards inherit both. Each step that fails is reported and skipped, returns -1 if any did. */
+int realtime_setup(int priority, int cpu) {
+  struct sched_param param = { .sched_priority = priority };
+  cpu_set_t cpus;
+  int returncode = 0;
+
+  if(priority > 0) {
+    if(priority > sched_get_priority_max(SCHED_FIFO)) { param.sched_priority = sched_get_priority_max(SCHED_FIFO); }
+    if(sched_setscheduler(0, SCHED_FIFO, &param) < 0) {
+      fprintf(stderr, "SCHED_FIFO priority %d not available, running at normal priority: %d: %s\n",
+              param.sched_priority, errno, strerror(errno));
+      returncode = -1;
+    }
+  }
+
+  if(cpu >= 0) {
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    if(sched_setaffinity(0, sizeof(cpus), &cpus) < 0) {
+      fprintf(stderr, "Pinning to CPU %d failed: %d: %s\n", cpu, errno, strerror(errno));
+      returncode = -1;
+    }
+  }
+  return returncode;
+}
+
+/* Lock memory and prefault the stack, so nothing page faults later. Done once the helper threads exist: with
+ * MCL_FUTURE every new thread stack counts against RLIMIT_MEMLOCK, which is small without CAP_IPC_LOCK. */
+int realtime_lock_memory(void) {
+  prefault_stack();
+  if(mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+    fprintf(stderr, "mlockall() failed, memory may be paged out: %d: %s\n", errno, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
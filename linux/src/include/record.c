@@ -0,0 +1,97 @@
+/* 
+ * Anachro Mouse, a usb to serial mouse adaptor. Copyright (C) 2021 Aviancer <oss+amouse@skyvian.me>
+ *
+ * This library is free software; you can redistribute it and/or modify it under the terms of the 
+ * GNU Lesser General Public License as published by the Free Software Foundation; either version 
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without 
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the 
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along with this library; 
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include <stdio.h>    // Standard input / output
+#include <errno.h>    // Error number definitions
+#include <string.h>   // strerror()
+
+#include "record.h"
+
+static void put_le(uint8_t *buf, uint32_t value, int bytes) {
+  for(int i=0; i < bytes; i++) { buf[i] = (value >> (i * 8)) & 0xff; }
+}
+
+static uint32_t get_le(uint8_t *buf, int bytes) {
+  uint32_t value = 0;
+  for(int i=0; i < bytes; i++) { value |= (uint32_t)buf[i] << (i * 8); }
+  return value;
+}
+
+// Open a recording for writing or reading, returns 0 or -1 if it can't be used.
+int record_open(record_t *record, const char *path, int write) {
+  char magic[sizeof(RECORD_MAGIC)];
+
+  memset(record, 0, sizeof(record_t));
+  record->file = fopen(path, write ? "wb" : "rb");
+  if(record->file == NULL) {
+    fprintf(stderr, "Recording %s open failed: %d: %s\n", path, errno, strerror(errno));
+    return -1;
+  }
+
+  if(write) {
+    fwrite(RECORD_MAGIC, sizeof(RECORD_MAGIC), 1, record->file);
+  }
+  else if(fread(magic, sizeof(magic), 1, record->file) != 1 || memcmp(magic, RECORD_MAGIC, sizeof(magic)) != 0) {
+    fprintf(stderr, "%s is not an amouse recording.\n", path);
+    record_close(record);
+    return -1;
+  }
+  return 0;
+}
+
+int record_write(record_t *record, int source, struct input_event *ev) {
+  uint8_t entry[RECORD_ENTRY_SIZE];
+  int64_t delta = 0;
+
+  if(record->started) {
+    delta = (ev->time.tv_sec - record->last.tv_sec) * 1000000 + (ev->time.tv_usec - record->last.tv_usec);
+    if(delta < 0) { delta = 0; } // Clock stepped back, keep the order at least
+    if(delta > UINT32_MAX) { delta = UINT32_MAX; }
+  }
+  record->last = ev->time;
+  record->started = 1;
+
+  put_le(entry, delta, 4);
+  entry[4] = source;
+  entry[5] = ev->type;
+  put_le(entry + 6, ev->code, 2);
+  put_le(entry + 8, ev->value, 4);
+  return fwrite(entry, sizeof(entry), 1, record->file) == 1 ? 0 : -1;
+}
+
+/* Next recorded event, its timestamp is the time since the first event of the recording.
+ * Returns 1 when ev was filled in, 0 at the end of the recording and -1 if the file is cut short. */
+int record_read(record_t *record, int *source, struct input_event *ev) {
+  uint8_t entry[RECORD_ENTRY_SIZE];
+  size_t size = fread(entry, 1, sizeof(entry), record->file);
+
+  if(size == 0) { return 0; }
+  if(size != sizeof(entry)) { return -1; }
+
+  record->elapsed += get_le(entry, 4);
+  ev->time.tv_sec = record->elapsed / 1000000;
+  ev->time.tv_usec = record->elapsed % 1000000;
+  *source = entry[4];
+  ev->type = entry[5];
+  ev->code = get_le(entry + 6, 2);
+  ev->value = (int32_t)get_le(entry + 8, 4);
+  return 1;
+}
+
+void record_close(record_t *record) {
+  if(record->file == NULL) { return; }
+  fclose(record->file);
+  record->file = NULL;
+}
@@ -0,0 +1,42 @@
+/* 
+ * Anachro Mouse, a usb to serial mouse adaptor. Copyright (C) 2021 Aviancer <oss+amouse@skyvian.me>
+ *
+ * This library is free software; you can redistribute it and/or modify it under the terms of the 
+ * GNU Lesser General Public License as published by the Free Software Foundation; either version 
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without 
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the 
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along with this library; 
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef RECORD_H_   /* Include guard */
+#define RECORD_H_
+
+#include <stdio.h>        // FILE
+#include <stdint.h>       // for uint32_t
+#include <linux/input.h>  // struct input_event
+
+#define RECORD_MAGIC "AMOUSEREC1" // File header, bump the number if the entry layout changes
+#define RECORD_ENTRY_SIZE 12      // delta_us(4) source(1) type(1) code(2) value(4), little endian
+
+// Recorded input event stream, events are stored with the time passed since the previous one.
+typedef struct record {
+  FILE *file;
+  struct timeval last; // Timestamp of previous event written
+  uint64_t elapsed;    // Microseconds from first event to the last one read
+  int started;
+} record_t;
+
+int record_open(record_t *record, const char *path, int write);
+
+int record_write(record_t *record, int source, struct input_event *ev);
+
+int record_read(record_t *record, int *source, struct input_event *ev);
+
+void record_close(record_t *record);
+
+#endif // RECORD_H_
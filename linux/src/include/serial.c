@@ -21,23 +21,82 @@
 #include <string.h> // strerror()
 #include <stdint.h> // for uint8_t
 #include <time.h> // for time()
+#include <pthread.h> // modem status watcher thread
+#include <limits.h> // PTHREAD_STACK_MIN
+#include <signal.h> // pthread_kill(), interrupting watcher threads
+#include <semaphore.h> // drain watcher wake ups
 
 #include <sys/ioctl.h> // ioctl (serial pins, mouse exclusive access)
+#include <linux/serial.h> // struct serial_icounter_struct
 
 #include "serial.h"
+#include "mouse.h"
 
 uint8_t pkt_intellimouse_intro[] = "\x4D\x5A";
+uint8_t pkt_logitech_intro[] = "\x4D\x33";
  
 /*** Serial comms ***/
 
-/* Write to serial out with enforced order, otherwise we may have bytes flipped */
-int serial_write(int fd, uint8_t *buffer, int size) { 
-  int written=0;
-  for(int i=0; i < size; i++) {
-    write(fd, &buffer[i], 1);
-    written++;
-  }  
-  return written;
+/* Write a whole packet with one syscall, so it can go out as a single USB transfer on adapters.
+ * If the tty buffer is full the rest is kept in the port, serial_write_pending() finishes it once there's room.
+ * A packet is never written while the previous one is unfinished, that would tear both apart on the line.
+ * Returns 0 if written, 1 if part of it is pending and -1 if it was dropped. */
+int serial_write_packet(serial_port_t *port, uint8_t *buffer, int size) {
+  if(port->pending_size > 0 || size > SERIAL_PENDING_MAX) {
+    port->stats.failed_writes++;
+    return -1;
+  }
+  memcpy(port->pending, buffer, size);
+  port->pending_size = size;
+  port->pending_sent = 0;
+  return serial_write_pending(port);
+}
+
+// Write what's left of a pending packet. Returns 0 once nothing is left, 1 while the tty has no room and -1 on errors.
+int serial_write_pending(serial_port_t *port) {
+  int left;
+  ssize_t result;
+
+  while(port->pending_sent < port->pending_size) {
+    left = port->pending_size - port->pending_sent;
+    result = write(port->fd, &port->pending[port->pending_sent], left);
+    if(result < 0) {
+      if(errno == EINTR) { continue; }
+      if(errno == EAGAIN) { // tty buffer full, wait for room without stalling everything else.
+        port->stats.blocked++;
+        return 1;
+      }
+      port->stats.failed_writes++;
+      port->pending_size = 0;
+      return -1;
+    }
+    if(result < left) { port->stats.short_writes++; }
+    port->pending_sent += result;
+  }
+
+  if(port->pending_size > 0) {
+    port->stats.packets++;
+    port->stats.bytes += port->pending_size;
+    port->pending_size = 0;
+  }
+  return 0;
+}
+
+// Forget everything not yet sent, the PC is starting over anyway. Also cancels a pending speed change.
+void serial_discard(serial_port_t *port) {
+  if(port->pending_size > 0) { port->stats.failed_writes++; }
+  port->pending_size = 0;
+  port->baud_next = 0;
+  tcflush(port->fd, TCOFLUSH);
+}
+
+void print_serial_stats(serial_stats_t *stats) {
+  printf("Serial: %lu packets, %lu bytes, %lu short writes, %lu blocked, %lu failed writes\n",
+         stats->packets, stats->bytes, stats->short_writes, stats->blocked, stats->failed_writes);
+  if(stats->queue_waits || stats->line_idle) {
+    printf("Pacing: %lu waits for a fuller output queue than expected, %lu times the line went idle first\n",
+           stats->queue_waits, stats->line_idle);
+  }
 }
 
 int get_pin(int fd, int flag) {
@@ -67,7 +126,7 @@ int disable_pin(int fd, int flag) {
   return 0;
 }
 
-int setup_tty(int fd, speed_t baudrate) {
+int setup_tty(int fd, speed_t baudrate, int data_bits) {
   struct termios tty;
   tcgetattr(fd, &tty);
 
@@ -78,10 +137,10 @@ int setup_tty(int fd, speed_t baudrate) {
   cfmakeraw(&tty); // Make tty raw, needs to be pointer
 
   /* Setting other Port Stuff, note: "->" for pointer, "." for direct ref */
-  tty.c_cflag     &=  ~PARENB;            // Make 7n1
+  tty.c_cflag     &=  ~PARENB;            // Make 7n1 or 8n1
   tty.c_cflag     &=  ~CSTOPB;            // 1 stop bit
   tty.c_cflag     &=  ~CSIZE;
-  tty.c_cflag     |=  CS7;                // CS7=7bit, CS8=8bit
+  tty.c_cflag     |=  (data_bits == 8) ? CS8 : CS7; // CS7=7bit, CS8=8bit
   
   tty.c_cflag     &=  ~CRTSCTS;           // no flow control
   tty.c_cc[VMIN]   =  1;                  // read doesn't block  (optional)
@@ -96,34 +155,361 @@ int setup_tty(int fd, speed_t baudrate) {
   return 0;
 }
 
+/*** Line speed ***/
+
+speed_t baud_to_speed(int baud) {
+  switch(baud) {
+    case 1200: return B1200;
+    case 2400: return B2400;
+    case 4800: return B4800;
+    case 9600: return B9600;
+  }
+  return B0;
+}
+
+int speed_to_baud(speed_t speed) {
+  switch(speed) {
+    case B1200: return 1200;
+    case B2400: return 2400;
+    case B4800: return 4800;
+    case B9600: return 9600;
+  }
+  return 0;
+}
+
+/* Logitech style baud rate switching, the PC sends '*' followed by a letter for the rate.
+ * Returns requested baud rate once a full command has been seen, otherwise 0. */
+int baud_command(uint8_t byte, int *star) {
+  int baud = 0;
+  if(*star) {
+    switch(byte) {
+      case 'n': baud = 9600; break;
+      case 'o': baud = 4800; break;
+      case 'p': baud = 2400; break;
+      case 'q': baud = 1200; break;
+    }
+  }
+  *star = (byte == '*');
+  return baud;
+}
+
+// Time for one character on the line in nanoseconds, from the ports active speed and frame format.
+long serial_char_time(int fd) {
+  struct termios tty;
+  int bits = 1; // Start bit
+  int baud = 0;
+
+  if(tcgetattr(fd, &tty) == 0) { baud = speed_to_baud(cfgetospeed(&tty)); }
+  if(baud == 0) { return (NS_FULL_SECOND * 9) / 1200; } // Not a tty or unknown speed, assume 1200 7n1.
+
+  switch(tty.c_cflag & CSIZE) {
+    case CS5: bits += 5; break;
+    case CS6: bits += 6; break;
+    case CS7: bits += 7; break;
+    default:  bits += 8;
+  }
+  if(tty.c_cflag & PARENB) { bits++; }
+  bits += (tty.c_cflag & CSTOPB) ? 2 : 1;
+
+  return (NS_FULL_SECOND * bits) / baud;
+}
+
+/* Change speed of an already set up port. Bytes already queued have to go out at the old speed first, rather than
+ * waiting for them the change is left in baud_next and 1 returned, with delay set to nanoseconds until it should be
+ * tried again. Returns 0 once changed. */
+int serial_set_baud(serial_port_t *port, int baud, uint32_t *delay) {
+  struct termios tty;
+  speed_t speed = baud_to_speed(baud);
+  int queued = 0;
+
+  if(speed == B0 || tcgetattr(port->fd, &tty) != 0) { return -1; }
+  if(ioctl(port->fd, TIOCOUTQ, &queued) < 0) { queued = 0; } // Can't tell, the driver has had a character time
+  if(queued > 0 || port->pending_size > 0) {
+    port->baud_next = baud;
+    *delay = (queued + port->pending_size - port->pending_sent + 1) * port->char_time;
+    return 1;
+  }
+
+  cfsetospeed(&tty, speed);
+  cfsetispeed(&tty, speed);
+  port->baud_next = 0;
+  if(tcsetattr(port->fd, TCSANOW, &tty) != 0) {
+    printf("serial_set_baud(%d) failed: %d: %s\n", baud, errno, strerror(errno));
+    return -1;
+  }
+  port->baud = baud;
+  port->char_time = serial_char_time(port->fd);
+  return 0;
+}
+
+// Time to wait between packets so we never send faster than the line can carry them.
+uint32_t packet_time(serial_port_t *port, int bytes) {
+  long time = port->char_time * bytes;
+
+  // Queue pacing checks the real queue when the last character should be on the line, no margin needed.
+  if(port->pacing == PACING_QUEUE) { return time - port->char_time; }
+  return time + (time / SERIAL_PACING_MARGIN);
+}
+
+// Pick pacing mode, falls back to fixed pacing if the driver can't tell how full its output queue is.
+int serial_pacing_init(serial_port_t *port, int pacing) {
+  int value;
+
+  port->pacing = PACING_FIXED;
+  if(pacing != PACING_QUEUE) { return 0; }
+
+  if(ioctl(port->fd, TIOCOUTQ, &value) < 0) {
+    printf("Output queue depth not available, using fixed pacing: %d: %s\n", errno, strerror(errno));
+    return -1;
+  }
+  port->has_lsr = ioctl(port->fd, TIOCSERGETLSR, &value) == 0; // Most USB adapters can't
+  port->pacing = PACING_QUEUE;
+  return 0;
+}
+
+/* Queue pacing, whether the line is about to go idle and the next packet should be built now.
+ * At most the character being shifted out may be left in the queue, so motion never goes stale in a buffer.
+ * If not ready, delay is set to nanoseconds until it should be. */
+int serial_line_ready(serial_port_t *port, uint32_t *delay) {
+  int queued = 0;
+  int lsr = 0;
+
+  if(port->pacing != PACING_QUEUE || ioctl(port->fd, TIOCOUTQ, &queued) < 0) { return 1; }
+
+  if(queued <= 1) {
+    if(queued == 0 && port->has_lsr && ioctl(port->fd, TIOCSERGETLSR, &lsr) == 0 && (lsr & TIOCSER_TEMT)) {
+      port->stats.line_idle++; // Line had already gone quiet, we woke up late
+    }
+    return 1;
+  }
+  port->stats.queue_waits++;
+  *delay = (queued - 1) * port->char_time;
+  return 0;
+}
+
+// Sleep in the kernel until a modem line changes, falls back to polling if driver can't do that.
+static int wait_modem_change(int fd, int flag) {
+  if(ioctl(fd, TIOCMIWAIT, flag) == 0 || errno == EINTR) { return 0; }
+  usleep(MODEM_POLL_INTERVAL);
+  return -1;
+}
+
 void wait_pin_state(int fd, int flag, int desired_state) {
   // Monitor
-  int pin_state = -1;
+  int pin_state = get_pin(fd, flag);
   while(pin_state != desired_state) { 
+    wait_modem_change(fd, flag);
     pin_state = get_pin(fd, flag);
-    usleep(1);
   }
 }
 
-void mouse_ident(int fd, int wheel_enabled, int immediate) {
+/*** Modem status watcher ***/
+
+// Lines which have changed state since the previous call, going by the drivers transition counters.
+static int modem_transitions(int fd, struct serial_icounter_struct *prev) {
+  struct serial_icounter_struct icount;
+  int changed = 0;
+
+  if(ioctl(fd, TIOCGICOUNT, &icount) < 0) { return 0; } // Not supported, rely on line states only.
+  if(icount.cts != prev->cts) { changed |= TIOCM_CTS; }
+  if(icount.dsr != prev->dsr) { changed |= TIOCM_DSR; }
+  *prev = icount;
+  return changed;
+}
+
+/*** Watcher threads ***/
+
+static void watch_stop_handler(int signal) { // Only there to make blocking calls return EINTR
+  (void)signal;
+}
+
+// Lets a watcher thread be interrupted out of TIOCMIWAIT or tcdrain(), no SA_RESTART so they return.
+static void watch_signal_init(void) {
+  struct sigaction action = { .sa_handler = watch_stop_handler };
+
+  sigemptyset(&action.sa_mask);
+  sigaction(WATCH_STOP_SIGNAL, &action, NULL);
+}
+
+/* Stop and join a watcher thread that has been told to stop. It may be blocked in the kernel or just about to be,
+ * so keep kicking it with a signal until it says it's done. */
+static void watch_join(pthread_t thread, atomic_int *done) {
+  while(!atomic_load(done)) {
+    pthread_kill(thread, WATCH_STOP_SIGNAL);
+    usleep(WATCH_STOP_RETRY);
+  }
+  pthread_join(thread, NULL);
+}
+
+static void *modem_watch_thread(void *arg) {
+  modem_watch_t *watch = (modem_watch_t*) arg;
+  struct serial_icounter_struct icount = {0};
+  modem_edge_t edge;
+  int lines = -1;
+  int serial_state, missed;
+  int polling = 0;
+
+  modem_transitions(watch->fd, &icount);
+
+  while(!atomic_load(&watch->stop)) {
+    if(ioctl(watch->fd, TIOCMGET, &serial_state) < 0) {
+      printf("Reading modem lines failed, PC driver init can't be detected: %d: %s\n", errno, strerror(errno));
+      break;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &edge.time); // As close to the edge as we get.
+
+    // A line which toggled and came back while we weren't waiting, report the state we missed first.
+    missed = modem_transitions(watch->fd, &icount) & watch->flag;
+    if(lines >= 0 && (serial_state & watch->flag) == lines && missed) {
+      edge.lines = lines ^ missed;
+      write(watch->pipe_fd[1], &edge, sizeof(edge));
+    }
+
+    // Only report actual changes, TIOCMIWAIT can wake up for lines we don't care about.
+    if((serial_state & watch->flag) != lines || missed) {
+      lines = serial_state & watch->flag;
+      edge.lines = lines;
+      write(watch->pipe_fd[1], &edge, sizeof(edge));
+    }
+
+    if(wait_modem_change(watch->fd, watch->flag) < 0 && !polling) {
+      printf("TIOCMIWAIT not supported by serial driver, polling modem lines instead.\n");
+      polling = 1;
+    }
+  }
+  atomic_store(&watch->done, 1);
+  return NULL;
+}
+
+int modem_watch_start(modem_watch_t *watch, int fd, int flag) {
+  pthread_attr_t attr;
+
+  watch->fd = fd;
+  watch->flag = flag;
+  atomic_init(&watch->stop, 0);
+  atomic_init(&watch->done, 0);
+  if(pipe(watch->pipe_fd) < 0) {
+    printf("modem_watch_start() pipe failed: %d: %s\n", errno, strerror(errno));
+    return -1;
+  }
+
+  watch_signal_init();
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, WATCH_STACK_SIZE < PTHREAD_STACK_MIN ? PTHREAD_STACK_MIN : WATCH_STACK_SIZE);
+  errno = pthread_create(&watch->thread, &attr, modem_watch_thread, watch);
+  pthread_attr_destroy(&attr);
+  if(errno != 0) {
+    printf("modem_watch_start() thread failed: %d: %s\n", errno, strerror(errno));
+    close(watch->pipe_fd[0]);
+    close(watch->pipe_fd[1]);
+    return -1;
+  }
+  watch->running = 1;
+  return watch->pipe_fd[0];
+}
+
+int modem_watch_read(modem_watch_t *watch, modem_edge_t *edge) {
+  if(read(watch->pipe_fd[0], edge, sizeof(*edge)) != sizeof(*edge)) { return -1; }
+  return 0;
+}
+
+// Join the watcher and close its pipe, has to be done before the serial port is closed and its fd reused.
+void modem_watch_stop(modem_watch_t *watch) {
+  if(!watch->running) { return; }
+
+  atomic_store(&watch->stop, 1);
+  watch_join(watch->thread, &watch->done);
+  close(watch->pipe_fd[0]);
+  close(watch->pipe_fd[1]);
+  watch->running = 0;
+}
+
+static void *drain_watch_thread(void *arg) {
+  drain_watch_t *watch = (drain_watch_t*) arg;
+  struct timespec time_now;
+  uint64_t written, drained = 0;
+
+  while(!atomic_load(&watch->stop)) {
+    if(sem_wait(&watch->pending) < 0) { continue; } // EINTR
+    written = atomic_load(&watch->written);
+    if(written == drained) { continue; } // Several writes drained at once, already counted
+
+    if(tcdrain(watch->fd) < 0) {
+      if(errno == EINTR) { continue; } // Checks whether we were told to stop
+      break; // Port failed
+    }
+    clock_gettime(CLOCK_MONOTONIC, &time_now);
+    hist_record(watch->histogram, (timespec_ns(&time_now) - written) / 1000);
+    drained = written;
+  }
+  atomic_store(&watch->done, 1);
+  return NULL;
+}
+
+int drain_watch_start(drain_watch_t *watch, int fd, histogram_t *histogram) {
+  pthread_attr_t attr;
+
+  watch->fd = fd;
+  watch->histogram = histogram;
+  atomic_init(&watch->written, 0);
+  atomic_init(&watch->stop, 0);
+  atomic_init(&watch->done, 0);
+  if(sem_init(&watch->pending, 0, 0) < 0) {
+    printf("drain_watch_start() semaphore failed: %d: %s\n", errno, strerror(errno));
+    return -1;
+  }
+
+  watch_signal_init();
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, WATCH_STACK_SIZE < PTHREAD_STACK_MIN ? PTHREAD_STACK_MIN : WATCH_STACK_SIZE);
+  errno = pthread_create(&watch->thread, &attr, drain_watch_thread, watch);
+  pthread_attr_destroy(&attr);
+  if(errno != 0) {
+    printf("drain_watch_start() thread failed: %d: %s\n", errno, strerror(errno));
+    sem_destroy(&watch->pending);
+    return -1;
+  }
+  watch->running = 1;
+  return 0;
+}
+
+// A packet was written at time, start timing how long it takes to drain.
+void drain_watch_written(drain_watch_t *watch, struct timespec *time) {
+  atomic_store(&watch->written, timespec_ns(time));
+  sem_post(&watch->pending);
+}
+
+void drain_watch_stop(drain_watch_t *watch) {
+  if(!watch->running) { return; }
+
+  atomic_store(&watch->stop, 1);
+  sem_post(&watch->pending); // Wake it up if it's waiting for a write
+  watch_join(watch->thread, &watch->done);
+  sem_destroy(&watch->pending);
+  watch->running = 0;
+}
+
+void mouse_ident(serial_port_t *port, int protocol, int wheel_enabled, int immediate) {
+  if(protocol == PROTO_MOUSESYSTEMS) { return; } // Mouse Systems mice don't identify themselves.
+
   /*** Microsoft Mouse proto negotiation ***/
   if(!immediate) {
-    wait_pin_state(fd, TIOCM_CTS | TIOCM_DSR, 0); // Computers RTS & DTR
-    wait_pin_state(fd, TIOCM_CTS, 1); 
     usleep(14); // Simulate real mouse start up.
   }
   /* Byte1:Always M
    * Byte2:[None]=Microsoft 3=Logitech Z=MicrosoftWheel  */
-  //uint8_t logitech[] = "\x4D\x33";
   //uint8_t microsoft[] = "\x4D";
   /* IntelliMouse: MZ@... */
   //uint8_t pkt_intellimouse_intro[] = "\x4D\x5A"; // MZ
 
-  if(wheel_enabled) {
-    serial_write(fd, pkt_intellimouse_intro, sizeof(pkt_intellimouse_intro)); // 2 byte intro is sufficient
+  if(protocol == PROTO_LOGITECH) {
+    serial_write_packet(port, pkt_logitech_intro, sizeof(pkt_logitech_intro) - 1); // M3
+  }
+  else if(wheel_enabled) {
+    serial_write_packet(port, pkt_intellimouse_intro, sizeof(pkt_intellimouse_intro)); // 2 byte intro is sufficient
   }
   else {
-    serial_write(fd, pkt_intellimouse_intro, 1); // M for basic Microsoft proto. 
+    serial_write_packet(port, pkt_intellimouse_intro, 1); // M for basic Microsoft proto. 
   }
 }
 
@@ -136,19 +522,26 @@ void timespec_diff(struct timespec *ts1, struct timespec *ts2, struct timespec *
   }
 }
 
+uint64_t timespec_ns(struct timespec *time) {
+  return (uint64_t)time->tv_sec * NS_FULL_SECOND + time->tv_nsec;
+}
+
+// Time delay nanoseconds after start.
+struct timespec timespec_after(struct timespec *start, uint64_t delay) {
+  struct timespec time = *start;
+
+  time.tv_sec += delay / NS_FULL_SECOND;
+  time.tv_nsec += delay % NS_FULL_SECOND;
+  if(time.tv_nsec >= NS_FULL_SECOND) {
+    time.tv_sec++;
+    time.tv_nsec -= NS_FULL_SECOND;
+  }
+  return time;
+}
+
 struct timespec get_target_time(uint32_t delay) {
   struct timespec time;
   clock_gettime(CLOCK_MONOTONIC, &time);
 
-  // 1200 baud (bits/s) is 133.333333333... bytes/s
-  // 44.44.. updates per second with 3 bytes.
-  // 33.25.. updates per second with 4 bytes.
-  // ~0.0075 seconds per byte, target time calculated for 4 bytes.
-
-  uint32_t now_nsec; 
-  now_nsec = time.tv_nsec;
-  time.tv_nsec = (time.tv_nsec + delay) % NS_FULL_SECOND;
-  if(time.tv_nsec < now_nsec) { time.tv_sec++; }
-
-  return time;
+  return timespec_after(&time, delay);
 }
@@ -16,17 +16,102 @@
 #ifndef SERIAL_H_
 #define SERIAL_H_
 
-/* Protocol definitions */
-#define MOUSE_LMB_BIT 5 // Defines << shift for bit position
-#define MOUSE_RMB_BIT 4
-#define MOUSE_MMB_BIT 4 // Shift 4 times in 4th byte
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdatomic.h>
+
+#include "histogram.h"
 
-// Delay between data packets for 1200 baud
 #define NS_FULL_SECOND 1000000000L   // 1s in nanoseconds
-#define SERIALDELAY_3B   22700000    // 3 bytes
-#define SERIALDELAY_4B   30000000    // 4 bytes
 
-int serial_write(int fd, uint8_t *buffer, int size);
+// Delay between data packets is derived from the line speed and framing, e.g. 1200 baud 7n1:
+// 1200 baud (bits/s) is 133.333333333... bytes/s with 9 bits per byte (start, 7 data, stop).
+// 44.44.. updates per second with 3 bytes.
+// 33.33.. updates per second with 4 bytes.
+// Packet time is padded by 1/SERIAL_PACING_MARGIN to allow for clock error between us and the UART.
+#define SERIAL_PACING_MARGIN 100
+
+// Fallback for serial drivers without TIOCMIWAIT support
+#define MODEM_POLL_INTERVAL 1000     // 1ms in microseconds
+
+// Interrupts watcher threads blocked in the kernel when stopping them
+#define WATCH_STOP_SIGNAL SIGUSR2
+#define WATCH_STOP_RETRY 1000        // 1ms in microseconds, between kicks until the thread notices
+
+// Watcher threads only wait on the kernel, they don't need the default 8MB stack each
+#define WATCH_STACK_SIZE (64 * 1024)
+
+// Longest packet that can be left half written, waiting for room in the tty buffer
+#define SERIAL_PENDING_MAX 8
+
+// Counters for serial back-pressure
+typedef struct serial_stats {
+  unsigned long packets;       // Packets fully written
+  unsigned long bytes;
+  unsigned long short_writes;  // write() took only part of what was left of a packet
+  unsigned long blocked;       // tty buffer was full when writing
+  unsigned long failed_writes; // Packets given up on, or dropped while the previous one was still being written
+  unsigned long queue_waits;   // Queue pacing: output queue was fuller than the line speed says
+  unsigned long line_idle;     // Queue pacing: transmitter had gone idle before we got to send
+} serial_stats_t;
+
+// How packets are paced
+enum SERIAL_PACING {
+  PACING_FIXED = 0, // From line speed and framing
+  PACING_QUEUE = 1  // From the real output queue, next packet is built when the line is about to go idle
+};
+
+// Serial port we are talking to the PC through
+typedef struct serial_port {
+  int fd;
+  int baud;         // Current line speed
+  long char_time;   // Nanoseconds per character at current speed and framing
+  int baud_star;    // Last byte from PC was '*', start of a baud rate command
+  int pacing;
+  int has_lsr;      // Driver reports transmitter empty through TIOCSERGETLSR
+  int baud_next;    // Speed to switch to once the output queue has drained, 0 for none
+  uint8_t pending[SERIAL_PENDING_MAX]; // Packet the tty buffer had no room for all of
+  int pending_size;
+  int pending_sent; // Bytes of it already written
+  serial_stats_t stats;
+} serial_port_t;
+
+// Modem status line change, as seen by the watcher thread.
+typedef struct modem_edge {
+  int lines;            // State of watched TIOCM_* lines after the change
+  struct timespec time; // CLOCK_MONOTONIC time the change was seen at
+} modem_edge_t;
+
+typedef struct modem_watch {
+  int fd;         // Serial port being watched
+  int flag;       // TIOCM_* lines to watch
+  int pipe_fd[2]; // Edges are written to [1] by the watcher, read from [0]
+  int running;    // Thread was started and hasn't been joined yet
+  atomic_int stop;
+  atomic_int done;
+  pthread_t thread;
+} modem_watch_t;
+
+// Times how long written packets take to leave the tty, tcdrain() blocks so it gets a thread of its own.
+typedef struct drain_watch {
+  int fd;
+  sem_t pending;                 // Posted after every packet write
+  atomic_uint_least64_t written; // CLOCK_MONOTONIC nanoseconds of the latest write
+  histogram_t *histogram;        // Microseconds from write until output queue is empty
+  int running;
+  atomic_int stop;
+  atomic_int done;
+  pthread_t thread;
+} drain_watch_t;
+
+int serial_write_packet(serial_port_t *port, uint8_t *buffer, int size);
+
+int serial_write_pending(serial_port_t *port);
+
+void serial_discard(serial_port_t *port);
+
+void print_serial_stats(serial_stats_t *stats);
 
 int get_pin(int fd, int flag);
 
@@ -34,14 +119,46 @@ int enable_pin(int fd, int flag);
 
 int disable_pin(int fd, int flag);
 
-int setup_tty(int fd, speed_t baudrate);
+int setup_tty(int fd, speed_t baudrate, int data_bits);
+
+speed_t baud_to_speed(int baud);
+
+int speed_to_baud(speed_t speed);
+
+int baud_command(uint8_t byte, int *star);
+
+long serial_char_time(int fd);
+
+int serial_set_baud(serial_port_t *port, int baud, uint32_t *delay);
+
+uint32_t packet_time(serial_port_t *port, int bytes);
+
+int serial_pacing_init(serial_port_t *port, int pacing);
+
+int serial_line_ready(serial_port_t *port, uint32_t *delay);
 
 void wait_pin_state(int fd, int flag, int desired_state);
 
-void mouse_ident(int fd, int wheel, int immediate);
+int modem_watch_start(modem_watch_t *watch, int fd, int flag);
+
+int modem_watch_read(modem_watch_t *watch, modem_edge_t *edge);
+
+void modem_watch_stop(modem_watch_t *watch);
+
+int drain_watch_start(drain_watch_t *watch, int fd, histogram_t *histogram);
+
+void drain_watch_written(drain_watch_t *watch, struct timespec *time);
+
+void drain_watch_stop(drain_watch_t *watch);
+
+void mouse_ident(serial_port_t *port, int protocol, int wheel, int immediate);
 
 void timespec_diff(struct timespec *ts1, struct timespec *ts2, struct timespec *result);
 
+uint64_t timespec_ns(struct timespec *time);
+
+struct timespec timespec_after(struct timespec *start, uint64_t delay);
+
 struct timespec get_target_time(uint32_t delay);
 
 #endif // SERIAL_H_
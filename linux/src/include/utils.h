@@ -20,6 +20,10 @@ const char * byte_to_bitstring(uint8_t val);
 
 int clamp(int value, int min, int max);
 
+int take_motion(int *accum, int limit);
+
+int cap_motion(int *accum, int max);
+
 void aprint(const char *message);
 
 #endif // UTILS_H_
@@ -0,0 +1,444 @@
+/* 
+ * Anachro Mouse, a usb to serial mouse adaptor. Copyright (C) 2021 Aviancer <oss+amouse@skyvian.me>
+ *
+ * This library is free software; you can redistribute it and/or modify it under the terms of the 
+ * GNU Lesser General Public License as published by the Free Software Foundation; either version 
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without 
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the 
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along with this library; 
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* Loopback harness, runs amouse against a pseudo terminal and decodes what it sends with a reference
+ * Microsoft / IntelliMouse, Logitech or Mouse Systems decoder. Input is a synthetic recording fed in through --replay, so it's known exactly
+ * what should come out the other end and when. Reports lost motion, button order errors and latency from each
+ * input report to when the decoder has seen all of it. */
+
+#define _GNU_SOURCE   // posix_openpt() & co
+#include <stdio.h>    // Standard input / output
+#include <stdlib.h>   // Standard input / output
+#include <fcntl.h>    // File control defs, open()
+#include <unistd.h>   // UNIX standard function defs, close()
+#include <errno.h>    // Error number definitions
+#include <string.h>   // strerror()
+#include <stdint.h>   // for uint8_t
+#include <time.h>     // clock_gettime()
+#include <poll.h>     // poll()
+#include <getopt.h>   // getopt
+#include <termios.h>  // cfmakeraw()
+#include <sys/wait.h> // waitpid()
+
+#include "record.h"
+#include "mouse.h"
+
+#define MAX_REPORTS 100000
+#define MAX_AMOUSE_ARGS 32
+
+enum LOOPBACK_BUTTONS { // Button bits as seen by the harness
+  LB_LMB = 1,
+  LB_RMB = 2,
+  LB_MMB = 4
+};
+
+// What one synthetic input report should add up to once decoded
+typedef struct expected {
+  uint64_t offset;  // Microseconds from start of replay
+  int x;            // Cumulative, only ever grows so it's clear when a report has made it through
+  int buttons;
+  int button_change;
+  int64_t latency;  // Filled in by the decoder, -1 until seen
+} expected_t;
+
+// Reference decoder state
+typedef struct decoder {
+  uint8_t packet[5];
+  int length;
+  int protocol;
+  int wheel_mode; // IntelliMouse, 4th byte after a packet carries MMB & wheel
+  int x, y, wheel;
+  int buttons;
+  int packets;
+  int framing_errors;
+} decoder_t;
+
+static uint64_t now_us() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (uint64_t)time.tv_sec * 1000000 + time.tv_nsec / 1000;
+}
+
+static void showhelp(char *name) {
+  printf("Usage: %s [options] <amouse binary> [amouse options]\n\n" \
+         "  -n <Count> of input reports to send (default: 500)\n" \
+         "  -t <Microseconds> between reports (default: 8000)\n" \
+         "  -x <Counts> of motion per report at most (default: 10)\n" \
+         "  -p <Protocol> for amouse to speak and the decoder to check: microsoft (default), logitech or mousesystems\n" \
+         "  -w Basic Microsoft protocol, no wheel or middle button\n" \
+         "  -r <Seed> for the random input\n" \
+         "  -v Show amouse output\n", name);
+}
+
+
+/*** Synthetic input ***/
+
+static void put_event(record_t *record, uint64_t offset, int type, int code, int value) {
+  struct input_event ev = { .type = type, .code = code, .value = value };
+
+  ev.time.tv_sec = offset / 1000000;
+  ev.time.tv_usec = offset % 1000000;
+  record_write(record, 0, &ev);
+}
+
+// Write count reports into a recording, filling in what each should decode to. Returns wheel total.
+static int make_input(record_t *record, expected_t *expected, int count, int interval, int max_x, int middle,
+                      int wheel_mode, int *y_total) {
+  int buttons_cycle[] = { LB_LMB, LB_RMB, LB_MMB };
+  int x = 0, buttons = 0, wheel = 0;
+  int toggle = 0;
+  int dx, dy;
+
+  *y_total = 0;
+  for(int i=0; i < count; i++) {
+    uint64_t offset = (uint64_t)i * interval;
+
+    dx = 1 + rand() % max_x;
+    dy = rand() % (2 * max_x + 1) - max_x;
+    put_event(record, offset, EV_REL, REL_X, dx);
+    put_event(record, offset, EV_REL, REL_Y, dy);
+    x += dx;
+    *y_total += dy;
+
+    expected[i].button_change = 0;
+    if(i % 25 == 24) { // Press or release a button now and then
+      int button = buttons_cycle[toggle++ % (middle ? 3 : 2)];
+      int code = button == LB_LMB ? BTN_LEFT : button == LB_RMB ? BTN_RIGHT : BTN_MIDDLE;
+
+      buttons ^= button;
+      put_event(record, offset, EV_KEY, code, (buttons & button) != 0);
+      expected[i].button_change = 1;
+    }
+    if(wheel_mode && i % 10 == 5) {
+      put_event(record, offset, EV_REL, REL_WHEEL, (i % 20 == 5) ? 1 : -2);
+      wheel += (i % 20 == 5) ? 1 : -2;
+    }
+    put_event(record, offset, EV_SYN, SYN_REPORT, 0);
+
+    expected[i].offset = offset;
+    expected[i].x = x;
+    expected[i].buttons = buttons;
+    expected[i].latency = -1;
+  }
+  return wheel;
+}
+
+
+/*** Reference decoder ***/
+
+static int sign_extend(int value, int bits) {
+  int sign = 1 << (bits - 1);
+  return (value ^ sign) - sign;
+}
+
+// Apply a complete 3 byte packet
+static void decode_packet(decoder_t *decoder) {
+  uint8_t *packet = decoder->packet;
+
+  decoder->x += sign_extend(((packet[0] & 0x03) << 6) | (packet[1] & 0x3f), 8);
+  decoder->y += sign_extend(((packet[0] & 0x0c) << 4) | (packet[2] & 0x3f), 8);
+  decoder->buttons = (decoder->buttons & LB_MMB) | ((packet[0] & 0x20) ? LB_LMB : 0) | ((packet[0] & 0x10) ? LB_RMB : 0);
+  decoder->packets++;
+}
+
+// IntelliMouse 4th byte, middle button and wheel
+static void decode_extra(decoder_t *decoder, uint8_t byte) {
+  decoder->wheel -= sign_extend(byte & 0x0f, 4); // Positive is down on the wire
+  decoder->buttons = (decoder->buttons & ~LB_MMB) | ((byte & 0x10) ? LB_MMB : 0);
+}
+
+// Logitech 4th byte, only sent when the middle button changes
+static void decode_logitech(decoder_t *decoder, uint8_t byte) {
+  decoder->buttons = (decoder->buttons & ~LB_MMB) | ((byte & 0x20) ? LB_MMB : 0);
+}
+
+/* Mouse Systems, a sync byte 10000LMR with buttons active low, then X, Y, X, Y deltas with positive Y up.
+ * Deltas can look like a sync byte, so one is only looked for where a packet should start. */
+static int decode_mousesystems(decoder_t *decoder, uint8_t byte) {
+  uint8_t *packet = decoder->packet;
+
+  if(decoder->length == 0 || decoder->length == 5) {
+    if((byte & 0xf8) != 0x80) { // Lost sync, skip until the next one
+      decoder->framing_errors++;
+      decoder->length = 0;
+      return 0;
+    }
+    packet[0] = byte;
+    decoder->length = 1;
+    return 0;
+  }
+
+  packet[decoder->length++] = byte;
+  if(decoder->length < 5) { return 0; }
+  decoder->x += (int8_t)packet[1] + (int8_t)packet[3];
+  decoder->y -= (int8_t)packet[2] + (int8_t)packet[4];
+  decoder->buttons = ((packet[0] & 0x04) ? 0 : LB_LMB) | ((packet[0] & 0x02) ? 0 : LB_MMB) |
+                     ((packet[0] & 0x01) ? 0 : LB_RMB);
+  decoder->packets++;
+  return 1;
+}
+
+/* Feed one byte. In the Microsoft protocols the first byte of a packet is the only one with bit 6 set.
+ * Returns 1 when it completed a packet or 4th byte and the state changed. */
+static int decode_byte(decoder_t *decoder, uint8_t byte) {
+  if(decoder->protocol == PROTO_MOUSESYSTEMS) { return decode_mousesystems(decoder, byte); }
+
+  if(byte & 0x40) {
+    if(decoder->length == 1 || decoder->length == 2) { decoder->framing_errors++; } // Cut short
+    decoder->packet[0] = byte;
+    decoder->length = 1;
+    return 0;
+  }
+
+  switch(decoder->length) {
+    case 1:
+    case 2:
+      decoder->packet[decoder->length++] = byte;
+      if(decoder->length == 3) {
+        decode_packet(decoder);
+        return 1;
+      }
+      return 0;
+    case 3:
+      decoder->length = 4;
+      if(decoder->protocol == PROTO_LOGITECH) {
+        decode_logitech(decoder, byte);
+        return 1;
+      }
+      if(decoder->wheel_mode) {
+        decode_extra(decoder, byte);
+        return 1;
+      }
+      decoder->framing_errors++;
+      return 0;
+    default:
+      decoder->framing_errors++; // Stray byte outside of any packet
+      return 0;
+  }
+}
+
+
+/*** Report ***/
+
+/* Microseconds from when a report went in to when it was decoded at time. Without an ident the clock can only start
+ * with the first packet, which may be a little late, so the result is never negative. */
+static int64_t report_latency(expected_t *expected, uint64_t start, uint64_t time) {
+  int64_t latency = (int64_t)(time - start) - (int64_t)expected->offset;
+  return latency < 0 ? 0 : latency;
+}
+
+static int compare_latency(const void *a, const void *b) {
+  int64_t diff = *(const int64_t*)a - *(const int64_t*)b;
+  return (diff > 0) - (diff < 0);
+}
+
+static void print_latency(int64_t *latencies, int count) {
+  if(count == 0) {
+    printf("Latency: nothing decoded\n");
+    return;
+  }
+  qsort(latencies, count, sizeof(int64_t), compare_latency);
+  printf("Latency (us, input report to decoded): n=%d p50=%ld p90=%ld p99=%ld max=%ld\n", count,
+         (long)latencies[count * 50 / 100], (long)latencies[count * 90 / 100], (long)latencies[count * 99 / 100],
+         (long)latencies[count - 1]);
+}
+
+
+/*** Main ***/
+
+int main(int argc, char **argv) {
+  int count = 500, interval = 8000, max_x = 10, wheel_mode = 1, verbose = 0;
+  int protocol = PROTO_MICROSOFT;
+  char *protocol_name = NULL;
+  unsigned int seed = 1;
+  int option;
+
+  while((option = getopt(argc, argv, "+hn:t:x:p:wr:v")) != -1) {
+    switch(option) {
+      case 'p':
+        protocol_name = optarg;
+        if(strcmp(optarg, "microsoft") == 0 || strcmp(optarg, "ms") == 0) { protocol = PROTO_MICROSOFT; }
+        else if(strcmp(optarg, "mousesystems") == 0 || strcmp(optarg, "msc") == 0) { protocol = PROTO_MOUSESYSTEMS; }
+        else if(strcmp(optarg, "logitech") == 0 || strcmp(optarg, "m3") == 0) { protocol = PROTO_LOGITECH; }
+        else {
+          fprintf(stderr, "Unknown protocol '%s'.\n", optarg);
+          exit(-1);
+        }
+        break;
+      case 'n': count = atoi(optarg); break;
+      case 't': interval = atoi(optarg); break;
+      case 'x': max_x = atoi(optarg); break;
+      case 'w': wheel_mode = 0; break;
+      case 'r': seed = atoi(optarg); break;
+      case 'v': verbose = 1; break;
+      default: showhelp(argv[0]); exit(0);
+    }
+  }
+  if(optind >= argc || count < 1 || count > MAX_REPORTS || max_x < 1 || max_x > 127) {
+    showhelp(argv[0]);
+    exit(0);
+  }
+  // The decoder has to know what's on the wire, a protocol only amouse was told about can't be checked.
+  for(int i=optind + 1; i < argc; i++) {
+    if(strncmp(argv[i], "-p", 2) == 0) {
+      fprintf(stderr, "Give -p before the amouse binary, so the decoder knows the protocol.\n");
+      exit(-1);
+    }
+  }
+  if(protocol != PROTO_MICROSOFT) { wheel_mode = 0; } // Wheel is a Microsoft extension
+  srand(seed);
+
+  /*** Input recording ***/
+  char recpath[] = "/tmp/amouse-loopback-XXXXXX";
+  int recfd = mkstemp(recpath);
+  record_t record;
+  expected_t *expected = calloc(count, sizeof(expected_t));
+  int y_total, wheel_total;
+
+  if(recfd < 0 || expected == NULL || record_open(&record, recpath, 1) < 0) {
+    fprintf(stderr, "Input recording setup failed: %d: %s\n", errno, strerror(errno));
+    exit(-1);
+  }
+  close(recfd);
+  wheel_total = make_input(&record, expected, count, interval, max_x, wheel_mode || protocol != PROTO_MICROSOFT,
+                           wheel_mode, &y_total);
+  record_close(&record);
+
+  /*** Pseudo terminal standing in for the serial port ***/
+  struct termios tty;
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+  if(master < 0 || grantpt(master) < 0 || unlockpt(master) < 0) {
+    fprintf(stderr, "pty setup failed: %d: %s\n", errno, strerror(errno));
+    exit(-1);
+  }
+  tcgetattr(master, &tty);
+  cfmakeraw(&tty);
+  tcsetattr(master, TCSANOW, &tty);
+
+  /*** amouse ***/
+  char *args[MAX_AMOUSE_ARGS + 10];
+  int argn = 0;
+  args[argn++] = argv[optind];
+  args[argn++] = "-i"; // pty has no modem lines
+  args[argn++] = "-s";
+  args[argn++] = ptsname(master);
+  args[argn++] = "--replay";
+  args[argn++] = recpath;
+  if(!wheel_mode) { args[argn++] = "-w"; }
+  if(protocol_name != NULL) {
+    args[argn++] = "-p";
+    args[argn++] = protocol_name;
+  }
+  for(int i=optind + 1; i < argc && argn < MAX_AMOUSE_ARGS + 9; i++) { args[argn++] = argv[i]; }
+  args[argn] = NULL;
+
+  pid_t pid = fork();
+  if(pid < 0) {
+    fprintf(stderr, "fork() failed: %d: %s\n", errno, strerror(errno));
+    exit(-1);
+  }
+  if(pid == 0) {
+    if(!verbose) {
+      int null_fd = open("/dev/null", O_WRONLY);
+      dup2(null_fd, STDOUT_FILENO);
+    }
+    execv(args[0], args);
+    fprintf(stderr, "Running %s failed: %d: %s\n", args[0], errno, strerror(errno));
+    _exit(127);
+  }
+
+  /*** Decode until amouse is done ***/
+  decoder_t decoder = { .protocol = protocol, .wheel_mode = wheel_mode };
+  struct pollfd pfd = { .fd = master, .events = POLLIN };
+  uint8_t buffer[256];
+  uint64_t start = 0, time;
+  int ident = wheel_mode || protocol == PROTO_LOGITECH ? 2 : 1; // M, MZ or M3
+  int padding = protocol != PROTO_MOUSESYSTEMS; // Anything without bit 6 right after the ident
+  if(protocol == PROTO_MOUSESYSTEMS) { ident = 0; } // Mouse Systems mice don't identify themselves
+  int next = 0; // First report not yet fully decoded
+  int buttons = 0, button_changes = 0, button_errors = 0, expected_button = 0;
+  int status = 0, exited = 0;
+  ssize_t size;
+
+  while(1) {
+    if(poll(&pfd, 1, 200) <= 0) {
+      if(exited) { break; }
+      if(waitpid(pid, &status, WNOHANG) == pid) { exited = 1; }
+      continue;
+    }
+    size = read(master, buffer, sizeof(buffer));
+    if(size <= 0) {
+      if(exited) { break; }
+      if(waitpid(pid, &status, WNOHANG) == pid) { exited = 1; }
+      else { usleep(1000); } // Slave not open yet or closed already
+      continue;
+    }
+    time = now_us();
+
+    for(int i=0; i < size; i++) {
+      if(start == 0) { start = time; } // Replay starts as soon as ident is out, or with the first packet without one
+      if(ident > 0 || (padding && decoder.packets == 0 && decoder.length == 0 && !(buffer[i] & 0x40))) {
+        if(ident > 0) { ident--; }
+        continue;
+      }
+      if(!decode_byte(&decoder, buffer[i])) { continue; }
+
+      // Button changes must come out in the order they went in
+      if(decoder.buttons != buttons) {
+        buttons = decoder.buttons;
+        button_changes++;
+        while(expected_button < count && !expected[expected_button].button_change) { expected_button++; }
+        if(expected_button < count && expected[expected_button].buttons == buttons) {
+          if(expected[expected_button].latency < 0) {
+            expected[expected_button].latency = report_latency(&expected[expected_button], start, time);
+          }
+          expected_button++;
+        }
+        else { button_errors++; }
+      }
+      // Reports whose motion has made it all the way through
+      while(next < count && decoder.x >= expected[next].x) {
+        if(!expected[next].button_change) { expected[next].latency = report_latency(&expected[next], start, time); }
+        next++;
+      }
+    }
+  }
+  if(!exited) { waitpid(pid, &status, 0); }
+  unlink(recpath);
+
+  /*** Report ***/
+  int64_t *latencies = calloc(count, sizeof(int64_t));
+  int latency_count = 0;
+  int missing_buttons = 0;
+
+  for(int i=0; i < count; i++) {
+    if(expected[i].latency >= 0) { latencies[latency_count++] = expected[i].latency; }
+    else if(expected[i].button_change) { missing_buttons++; }
+  }
+
+  int lost = abs(expected[count - 1].x - decoder.x) + abs(y_total - decoder.y) + abs(wheel_total - decoder.wheel);
+  printf("amouse exit status %d, %d reports over %.2fs\n", WEXITSTATUS(status), count, count * interval / 1e6);
+  printf("Packets: %d decoded, %d framing errors\n", decoder.packets, decoder.framing_errors);
+  printf("Motion: x %d/%d, y %d/%d, wheel %d/%d, %d counts lost\n", decoder.x, expected[count - 1].x,
+         decoder.y, y_total, decoder.wheel, wheel_total, lost);
+  printf("Buttons: %d changes decoded, %d out of order, %d missing\n", button_changes, button_errors, missing_buttons);
+  print_latency(latencies, latency_count);
+
+  free(latencies);
+  free(expected);
+  close(master);
+
+  return (lost || button_errors || missing_buttons || decoder.framing_errors || WEXITSTATUS(status)) ? 1 : 0;
+}
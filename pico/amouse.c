@@ -22,32 +22,34 @@
 #include <stdlib.h>
 #include <time.h>
 #include "pico/stdlib.h"
+#include "pico/multicore.h"
+#include "hardware/sync.h"
 
 #include "include/utils.h"
 #include "include/serial.h"
+#include "include/mouse.h"
+#include "include/accel.h"
+#include "include/report_queue.h"
+#include "include/hid_parser.h"
+#include "include/config.h"
 
 #include "bsp/board.h"
 #include "tusb.h"
 
-// Technically could support multiple mice connected to the same system if we kept more mouse states in memory.
-
-
 /*** Program parameters ***/ 
 
 // Struct for storing pointers to dynamically allocated memory containing options.
 typedef struct opts {
+  int protocol;
   int wheel;
+  int max_backlog; // Motion carried beyond one packet, -1 for unlimited
+  int sensitivity; // Percent
+  int accel_curve;
+  int accel_rate;  // Percent per count of speed
+  int accel_limit; // Percent, 0 for none
+  int idle_khz;    // System clock while no driver is active, 0 to keep full speed
 } opts_t;
 
-// Struct for storing information about accumulated mouse state
-typedef struct mouse_state {
-  int pc_state; // Current state of mouse driver initialization on PC.
-  uint8_t state[4]; // Mouse state
-  int x, y, wheel;
-  int update; // How many bytes to send
-  int lmb, rmb, mmb, force_update;
-} mouse_state_t;
-
 // States of mouse init request from PC
 enum PC_INIT_STATES {
   CTS_UNINIT   = 0, // Initial state
@@ -55,59 +57,138 @@ enum PC_INIT_STATES {
   CTS_TOGGLED  = 2  // CTS was low, now high -> do ident.
 };
 
+// Protocol to emulate is chosen at build time, see CMakeLists.txt
+#ifndef AMOUSE_PROTOCOL
+#define AMOUSE_PROTOCOL PROTO_MICROSOFT
+#endif
+
+// Motion scaling, also chosen at build time
+#ifndef AMOUSE_SENSITIVITY
+#define AMOUSE_SENSITIVITY 100
+#endif
+#ifndef AMOUSE_ACCEL
+#define AMOUSE_ACCEL ACCEL_FLAT
+#endif
+#ifndef AMOUSE_ACCEL_RATE
+#define AMOUSE_ACCEL_RATE 10
+#endif
+#ifndef AMOUSE_ACCEL_LIMIT
+#define AMOUSE_ACCEL_LIMIT 0
+#endif
+
+// Power saving, also chosen at build time
+#ifndef AMOUSE_IDLE_KHZ
+#define AMOUSE_IDLE_KHZ 48000
+#endif
+#define SYS_CLOCK_KHZ 125000 // SDK default system clock, what we run at while serving a driver
+
 void set_opts(struct opts *options) {
-  options->wheel = 1;
+  options->protocol = AMOUSE_PROTOCOL;
+  options->wheel = (AMOUSE_PROTOCOL == PROTO_MICROSOFT); // Wheel is a Microsoft extension
+  options->max_backlog = -1;
+  options->sensitivity = AMOUSE_SENSITIVITY;
+  options->accel_curve = AMOUSE_ACCEL;
+  options->accel_rate = AMOUSE_ACCEL_RATE;
+  options->accel_limit = AMOUSE_ACCEL_LIMIT;
+  options->idle_khz = AMOUSE_IDLE_KHZ;
 }
 
 
 /*** Global state variables ****/
 
 // Set default options, support mouse wheel.
-opts_t options = { .wheel=1 };
-
-static uint8_t init_mouse_state[] = "\x40\x00\x00\x00"; // Our basic mouse packet (We send 3 or 4 bytes of it)
+opts_t options = { .protocol=AMOUSE_PROTOCOL, .wheel=(AMOUSE_PROTOCOL == PROTO_MICROSOFT), .max_backlog=-1,
+                   .sensitivity=AMOUSE_SENSITIVITY, .accel_curve=AMOUSE_ACCEL, .accel_rate=AMOUSE_ACCEL_RATE,
+                   .accel_limit=AMOUSE_ACCEL_LIMIT, .idle_khz=AMOUSE_IDLE_KHZ };
 
 extern mouse_state_t mouse; // Needs to be available for serial functions.
 mouse_state_t mouse; // int values default to 0 
 
 static uint32_t txtimer_target; // Serial transmit timer target time
-
-// Aggregate movements before sending
-CFG_TUSB_MEM_SECTION static hid_mouse_report_t usb_mouse_report;
-CFG_TUSB_MEM_SECTION static hid_mouse_report_t usb_mouse_report_prev;
+static accel_t accel; // Gain table & sub-count carry
+static bool baud_star; // Last byte from PC was '*', start of a baud rate command
+
+// Settings kept in flash, protocol and wheel changes take effect at the next ident
+static config_t config;
+static config_t config_defaults; // As built
+static config_parser_t config_parser;
+static bool config_dirty;        // Changed since last written to flash, see config_flush()
+static uint32_t rx_seen_at;      // Last byte from the PC
+
+#define CONFIG_SAVE_QUIET_US 500000 // Line and CTS quiet this long before settings are written to flash
+
+// Driver init is detected from the CTS interrupt and ident is sent from an alarm, see cts_callback()
+static volatile int pc_state = CTS_UNINIT;
+static volatile uint32_t ident_count; // Idents sent, main loop starts a new session when this changes
+static volatile alarm_id_t ident_alarm_id; // Pending ident, 0 for none
+static volatile uint32_t cts_edge_at; // Time of the last CTS edge
+
+static int64_t ident_alarm(alarm_id_t id, void *user_data);
+
+// USB host runs on core 1, reports are handed to core 0 which owns the mouse state and UART.
+// Any number of mice behind a hub are merged into the one serial mouse.
+#define MAX_MICE CFG_TUSB_HOST_DEVICE_MAX
+
+// Per mouse USB state, indexed by device address - 1. Core 1 only.
+typedef struct usb_mouse {
+  bool mounted;
+  uint8_t slot;   // Slot the current transfer fills
+  int ready;      // Slot holding a completed report, -1 for none
+  bool pending;   // Transfer in flight
+  uint8_t buttons; // Buttons this mouse holds down
+  hid_plan_t plan; // How to pull motion and buttons out of its reports
+  uint8_t setup;   // Where describing the mouse has got to, see USB_SETUP_STATES
+  uint8_t itf_num; // Its boot mouse interface, for the HID class requests. USB_ITF_UNKNOWN until found
+  uint16_t report_desc_length;
+} usb_mouse_t;
+
+// After mount the report descriptor is fetched, parsed into a plan and the mouse is switched to report protocol.
+// Reports are only read once that's done. Falls back to the boot layout and boot protocol if any of it fails,
+// a mouse whose interface couldn't even be found can't be switched to boot protocol and is left alone.
+enum USB_SETUP_STATES { USB_SETUP_NEEDED, USB_SETUP_CONFIG, USB_SETUP_REPORT, USB_SETUP_PROTOCOL, USB_SETUP_DONE,
+                        USB_SETUP_FAILED };
+
+#define USB_ITF_UNKNOWN 0xFF
+#define HID_SET_PROTOCOL_BOOT 0
+#define HID_SET_PROTOCOL_REPORT 1
+#define USB_SETUP_BUFFER_SIZE 512 // Room for the configuration and report descriptors of any sane mouse
+
+// Reports are double buffered, a transfer fills one slot while the other waits to be processed. Core 1 only.
+// Sized for a full packet, the transfer takes as much as the mouse's endpoint sends.
+CFG_TUSB_MEM_SECTION CFG_TUSB_MEM_ALIGN static uint8_t usb_mouse_report[MAX_MICE][2][HID_REPORT_MAX];
+static usb_mouse_t usb_mice[MAX_MICE];
+// Descriptors are read one mouse at a time into a shared buffer. Core 1 only.
+CFG_TUSB_MEM_SECTION CFG_TUSB_MEM_ALIGN static uint8_t usb_setup_buffer[USB_SETUP_BUFFER_SIZE];
+static uint8_t usb_setup_addr; // Mouse being described, 0 for none
+static report_queue_t report_queue;
+static mouse_report_t held_report; // Core 1 only, report waiting for room in the queue
+static bool report_held;
+static uint8_t buttons_prev; // Core 0 only, to find button edges
+
+// Time each core spent asleep waiting for something to do, read with a debugger to see how idle we are.
+typedef struct idle_stats {
+  uint32_t wakeups;
+  uint64_t idle_us;
+} idle_stats_t;
+volatile idle_stats_t idle_stats[2]; // By core
+static bool slow_clock; // Running at options.idle_khz
 
 // DEBUG
 const uint LED_PIN = PICO_DEFAULT_LED_PIN;
 int led_state = 0;
 
 
-/*** Flow control functions ***/
-
-// Make sure we don't clobber higher update requests with lower ones.
-int push_update(mouse_state_t *mouse, int full_packet) {
-  if(full_packet || (mouse->update == 3)) { mouse->update = 3; }
-  else { mouse->update = 2; }
-}
-
-
 /*** USB comms ***/
 
-void tuh_hid_mouse_mounted_cb(uint8_t dev_addr) {
-  // printf("A Mouse device (address %d) is mounted\r\n", dev_addr);
-}
-
-void tuh_hid_mouse_unmounted_cb(uint8_t dev_addr) {
-  // printf("A Mouse device (address %d) is unmounted\r\n", dev_addr);
-}
-
 int test_mouse_button(uint8_t buttons_state, uint8_t button) {
   if(buttons_state & button) { return 1; }
   return 0;
 }
 
-static inline void process_mouse_report(mouse_state_t *mouse, hid_mouse_report_t const *p_report) {
+// Core 0: aggregate a report from the queue into the mouse state.
+static inline void process_mouse_report(mouse_state_t *mouse, mouse_report_t const *p_report) {
  
-  uint8_t button_changed_mask = p_report->buttons ^usb_mouse_report_prev.buttons; // xor to set bits true if any state is different.
+  uint8_t button_changed_mask = p_report->buttons ^ buttons_prev; // xor to set bits true if any state is different.
   //if(button_changed_mask & p_report->buttons) { // Could be used to act only on any button down press.
   if(button_changed_mask) { // If button pressed or released
     mouse->force_update = 1;
@@ -116,160 +197,515 @@ static inline void process_mouse_report(mouse_state_t *mouse, hid_mouse_report_t
     mouse->rmb = test_mouse_button(p_report->buttons, MOUSE_BUTTON_RIGHT);
     push_update(mouse, mouse->mmb);
 
-    if(options.wheel && (button_changed_mask & MOUSE_BUTTON_MIDDLE)) {
+    // Basic MS protocol has no middle button
+    if((options.wheel || options.protocol != PROTO_MICROSOFT) && (button_changed_mask & MOUSE_BUTTON_MIDDLE)) {
       mouse->mmb = test_mouse_button(p_report->buttons, MOUSE_BUTTON_MIDDLE);
       push_update(mouse, true);
     }
   }
     
   // ### Handle relative movement ###
-  if(p_report->x) {
-    mouse->x += p_report->x;
-    mouse->x = clamp(mouse->x, -127, 127);
-    push_update(mouse, mouse->mmb);
-  }
-  if(p_report->y) {
-    mouse->y += p_report->y;
-    mouse->y = clamp(mouse->y, -127, 127);
-    push_update(mouse, mouse->mmb);
+  if(p_report->x || p_report->y) {
+    int x = p_report->x;
+    int y = p_report->y;
+
+    accel_apply(&accel, &x, &y); // Slow movements may scale to nothing yet, the fraction carries over
+    if(x || y) {
+      mouse_add_motion(mouse, x, y, protocol_motion_max(options.protocol), options.max_backlog);
+      push_update(mouse, mouse->mmb);
+    }
   }
   if(options.wheel && p_report->wheel) {
       mouse->wheel += p_report->wheel;
-      mouse->wheel  = clamp(mouse->wheel, -15, 15);
+      cap_motion(&mouse->wheel, max_motion(options.max_backlog, MOUSE_WHEEL_MAX));
       push_update(mouse, true);
   }
 
-  // Update previous mouse state
-  usb_mouse_report_prev = *p_report;
+  // Update previous button state
+  buttons_prev = p_report->buttons;
+}
+
+// Core 1: try to get a held back report into the queue, returns true once nothing is held.
+static bool flush_held_report(void) {
+  if(report_held && report_queue_push(&report_queue, &held_report)) { report_held = false; }
+  return(!report_held);
+}
+
+// Core 1: pass a report on to core 0. While the queue is full motion is merged into a held back
+// report, button changes are never merged away so for those we wait for core 0 to make room.
+static void queue_report(mouse_report_t const *report) {
+  if(!flush_held_report() && report->buttons != held_report.buttons) {
+    while(!flush_held_report()) { tight_loop_contents(); }
+  }
+
+  if(report_held) {
+    held_report.x = clamp(held_report.x + report->x, INT16_MIN, INT16_MAX);
+    held_report.y = clamp(held_report.y + report->y, INT16_MIN, INT16_MAX);
+    held_report.wheel = clamp(held_report.wheel + report->wheel, INT8_MIN, INT8_MAX);
+    report_queue.merged++;
+    return;
+  }
+  if(!report_queue_push(&report_queue, report)) {
+    held_report = *report;
+    report_held = true;
+  }
+}
+
+static void usb_setup_next(uint8_t dev_addr, usb_mouse_t *usb_mouse, bool ok);
+
+static usb_mouse_t *usb_mouse_get(uint8_t dev_addr) {
+  if(dev_addr < 1 || dev_addr > MAX_MICE) { return(NULL); }
+  return(&usb_mice[dev_addr - 1]);
+}
+
+// A button is held as long as any of the mice holds it.
+static uint8_t merged_buttons(void) {
+  uint8_t buttons = 0;
+  for(int i=0; i < MAX_MICE; i++) {
+    if(usb_mice[i].mounted) { buttons |= usb_mice[i].buttons; }
+  }
+  return(buttons);
+}
+
+void tuh_hid_mouse_mounted_cb(uint8_t dev_addr) {
+  usb_mouse_t *usb_mouse = usb_mouse_get(dev_addr);
+  if(!usb_mouse) { return; }
+
+  usb_mouse->mounted = true;
+  usb_mouse->slot = 0;
+  usb_mouse->ready = -1;
+  usb_mouse->pending = false;
+  usb_mouse->buttons = 0;
+
+  // Descriptor requests are started from hid_task(), they can't be issued from inside enumeration
+  usb_mouse->setup = USB_SETUP_NEEDED;
+  usb_mouse->itf_num = USB_ITF_UNKNOWN;
+  hid_plan_boot(&usb_mouse->plan);
+}
+
+void tuh_hid_mouse_unmounted_cb(uint8_t dev_addr) {
+  usb_mouse_t *usb_mouse = usb_mouse_get(dev_addr);
+  if(!usb_mouse || !usb_mouse->mounted) { return; }
+
+  usb_mouse->mounted = false;
+  if(usb_setup_addr == dev_addr) { usb_setup_addr = 0; }
+  if(usb_mouse->buttons) { // Release whatever it was holding down
+    usb_mouse->buttons = 0;
+    mouse_report_t report = { .buttons=merged_buttons() };
+    queue_report(&report);
+  }
 }
 
-// invoked ISR context
+// Invoked from tuh_task() on core 1 once a report transfer has completed.
 void tuh_hid_mouse_isr(uint8_t dev_addr, xfer_result_t event) {
-  (void) dev_addr;
-  (void) event;
+  usb_mouse_t *usb_mouse = usb_mouse_get(dev_addr);
+  if(!usb_mouse) { return; }
+
+  usb_mouse->pending = false;
+  if(event != XFER_RESULT_SUCCESS) {
+    report_queue.dropped++;
+    return;
+  }
+
+  report_queue.received++;
+  if(usb_mouse->ready >= 0) { report_queue.dropped++; } // Previous report never got processed
+  usb_mouse->ready = usb_mouse->slot;
+  usb_mouse->slot ^= 1; // Next transfer goes to the other slot
 }
 
-// Process USB HID events.
+// Process USB HID events, each report exactly once after its transfer has completed.
+// This runs on core 1, however many mice there are doesn't affect serial timing on core 0.
 void hid_task(void) {
-  uint8_t const addr = 1;
+  flush_held_report();
+
+  for(uint8_t addr=1; addr <= MAX_MICE; addr++) {
+    usb_mouse_t *usb_mouse = usb_mouse_get(addr);
+    if(!usb_mouse->mounted) { continue; }
+
+    if(usb_mouse->setup != USB_SETUP_DONE) {
+      if(usb_mouse->setup == USB_SETUP_NEEDED && !usb_setup_addr) {
+        usb_setup_addr = addr;
+        usb_setup_next(addr, usb_mouse, true);
+      }
+      continue;
+    }
 
-  if(tuh_hid_mouse_is_mounted(addr)) {
-    if(!tuh_hid_mouse_is_busy(addr)) {
-      tuh_hid_mouse_get_report(addr, &usb_mouse_report);
-      process_mouse_report(&mouse, &usb_mouse_report);
+    // Start the next transfer first, it fills the other slot while we deal with this one
+    // The report callback doesn't tell how much arrived, a cleared slot makes a short report decode as if its
+    // real length had been given instead of picking up what an earlier report left behind.
+    if(!usb_mouse->pending && !tuh_hid_mouse_is_busy(addr)) {
+      memset(usb_mouse_report[addr - 1][usb_mouse->slot], 0, HID_REPORT_MAX);
+      usb_mouse->pending = (tuh_hid_mouse_get_report(addr, &usb_mouse_report[addr - 1][usb_mouse->slot]) == TUSB_ERROR_NONE);
+    }
+
+    if(usb_mouse->ready >= 0) {
+      uint8_t const *usb_report = usb_mouse_report[addr - 1][usb_mouse->ready];
+      int x, y, wheel;
+      uint8_t buttons;
+
+      usb_mouse->ready = -1;
+      if(!hid_plan_decode(&usb_mouse->plan, usb_report, HID_REPORT_MAX, &x, &y, &wheel, &buttons)) { continue; }
+      usb_mouse->buttons = buttons;
+
+      mouse_report_t report = { .x=clamp(x, INT16_MIN, INT16_MAX), .y=clamp(y, INT16_MIN, INT16_MAX),
+                                .wheel=clamp(wheel, INT8_MIN, INT8_MAX), .buttons=merged_buttons() };
+      queue_report(&report);
     }
   }
 }
 
-void reset_mouse_state(mouse_state_t *mouse) {
-  memcpy( mouse->state, init_mouse_state, sizeof(mouse->state) ); // Set packet memory to initial state
-  mouse->update = -1;
-  mouse->force_update = 0;
-  mouse->x = mouse->y = mouse->wheel = 0;
-  // Do not reset button states here, will be updated on release of buttons.
+/*** USB mouse setup ***/
+
+static bool usb_setup_complete(uint8_t dev_addr, tusb_control_request_t const *request, xfer_result_t result);
+
+static bool usb_setup_get_descriptor(uint8_t dev_addr, uint8_t recipient, uint8_t type, uint16_t index, uint16_t length) {
+  tusb_control_request_t const request = {
+    .bmRequestType_bit = { .recipient = recipient, .type = TUSB_REQ_TYPE_STANDARD, .direction = TUSB_DIR_IN },
+    .bRequest = TUSB_REQ_GET_DESCRIPTOR,
+    .wValue = type << 8,
+    .wIndex = index,
+    .wLength = length
+  };
+  return(tuh_control_xfer(dev_addr, &request, usb_setup_buffer, usb_setup_complete));
 }
 
-/*** Mainline mouse state logic ***/
+static bool usb_setup_set_protocol(uint8_t dev_addr, uint8_t itf_num, uint8_t protocol) {
+  tusb_control_request_t const request = {
+    .bmRequestType_bit = { .recipient = TUSB_REQ_RCPT_INTERFACE, .type = TUSB_REQ_TYPE_CLASS, .direction = TUSB_DIR_OUT },
+    .bRequest = HID_REQ_CONTROL_SET_PROTOCOL,
+    .wValue = protocol,
+    .wIndex = itf_num,
+    .wLength = 0
+  };
+  return(tuh_control_xfer(dev_addr, &request, NULL, usb_setup_complete));
+}
 
-bool serial_tx(mouse_state_t *mouse) {
-  if((mouse->update < 2) && (mouse->force_update == false)) { return(false); } // Minimum report size is 2 (3 bytes)
-  int movement;
+// Find the boot mouse interface TinyUSB bound to, and the length of its report descriptor.
+// Its mouse host driver only takes boot subclass mouse interfaces, a mouse on any other HID interface is never seen.
+static bool usb_setup_find_mouse(usb_mouse_t *usb_mouse, const uint8_t *desc, int length) {
+  bool in_mouse = false;
 
-  // Set mouse button states	
-  mouse->state[0] |= (mouse->lmb << MOUSE_LMB_BIT);
-  mouse->state[0] |= (mouse->rmb << MOUSE_RMB_BIT);
-  mouse->state[3] |= (mouse->mmb << MOUSE_MMB_BIT);
+  for(int i=0; i + 1 < length && desc[i] >= 2; i += desc[i]) {
+    if(i + desc[i] > length) { break; }
 
-  // Update aggregated mouse movement state
-  movement = mouse->x & 0xc0; // Get 2 upper bits of X movement
-  mouse->state[0] = mouse->state[0] | (movement >> 6); // Sets bit based on ev.value, 8th bit to 2nd bit (Discards bits)
-  mouse->state[1] = mouse->state[1] | (mouse->x & 0x3f); 
+    if(desc[i + 1] == TUSB_DESC_INTERFACE && desc[i] >= 9) {
+      in_mouse = (desc[i + 5] == TUSB_CLASS_HID && desc[i + 6] == HID_SUBCLASS_BOOT && desc[i + 7] == HID_PROTOCOL_MOUSE);
+      if(in_mouse) { usb_mouse->itf_num = desc[i + 2]; }
+    }
+    // HID descriptor follows the interface, first class descriptor listed in it is the report descriptor
+    else if(in_mouse && desc[i + 1] == HID_DESC_TYPE_HID && desc[i] >= 9 && desc[i + 6] == HID_DESC_TYPE_REPORT) {
+      usb_mouse->report_desc_length = desc[i + 7] | (desc[i + 8] << 8);
+      return(true);
+    }
+  }
+  return(false);
+}
 
-  movement = mouse->y & 0xc0; // Get 2 upper bits of Y movement
-  mouse->state[0] = mouse->state[0] | (movement >> 4);
-  mouse->state[2] = mouse->state[2] | (mouse->y & 0x3f); 
+// Moves a mouse on to the next setup request, or to boot protocol when there's nothing better.
+static void usb_setup_next(uint8_t dev_addr, usb_mouse_t *usb_mouse, bool ok) {
+  bool started = false;
+
+  switch(usb_mouse->setup) {
+    case USB_SETUP_NEEDED:
+      usb_mouse->setup = USB_SETUP_CONFIG;
+      started = usb_setup_get_descriptor(dev_addr, TUSB_REQ_RCPT_DEVICE, TUSB_DESC_CONFIGURATION, 0, USB_SETUP_BUFFER_SIZE);
+      break;
+
+    case USB_SETUP_CONFIG:
+      if(ok) {
+        int length = usb_setup_buffer[2] | (usb_setup_buffer[3] << 8); // wTotalLength, device may send less than asked
+        if(length > USB_SETUP_BUFFER_SIZE) { length = USB_SETUP_BUFFER_SIZE; }
+        ok = usb_setup_find_mouse(usb_mouse, usb_setup_buffer, length) &&
+             usb_mouse->report_desc_length <= USB_SETUP_BUFFER_SIZE;
+      }
+      if(ok) {
+        usb_mouse->setup = USB_SETUP_REPORT;
+        started = usb_setup_get_descriptor(dev_addr, TUSB_REQ_RCPT_INTERFACE, HID_DESC_TYPE_REPORT,
+                                           usb_mouse->itf_num, usb_mouse->report_desc_length);
+      }
+      break;
 
-  mouse->state[3] = mouse->state[3] | (-mouse->wheel & 0x0f); // 127(negatives) when scrolling up, 1(positives) when scrolling down.
+    case USB_SETUP_REPORT:
+      if(ok && hid_plan_parse(&usb_mouse->plan, usb_setup_buffer, usb_mouse->report_desc_length)) {
+        usb_mouse->setup = USB_SETUP_PROTOCOL;
+        started = usb_setup_set_protocol(dev_addr, usb_mouse->itf_num, HID_SET_PROTOCOL_REPORT);
+      }
+      break;
+
+    case USB_SETUP_PROTOCOL:
+      // Devices start in report protocol, so a stalled request still leaves the parsed plan right
+      usb_mouse->setup = USB_SETUP_DONE;
+      usb_setup_addr = 0;
+      return;
+  }
+  if(started) { return; }
+
+  // Couldn't describe the mouse, read it the way the boot protocol lays reports out once it's been told to use it
+  hid_plan_boot(&usb_mouse->plan);
+  if(usb_mouse->itf_num != USB_ITF_UNKNOWN) {
+    usb_mouse->setup = USB_SETUP_PROTOCOL;
+    if(usb_setup_set_protocol(dev_addr, usb_mouse->itf_num, HID_SET_PROTOCOL_BOOT)) { return; }
+    usb_mouse->setup = USB_SETUP_DONE;
+  }
+  else { usb_mouse->setup = USB_SETUP_FAILED; } // Report layout unknown and no interface to ask for boot protocol on
+  usb_setup_addr = 0;
+}
+
+// Invoked from tuh_task() on core 1 once a setup request has completed.
+static bool usb_setup_complete(uint8_t dev_addr, tusb_control_request_t const *request, xfer_result_t result) {
+  (void)request;
+  usb_mouse_t *usb_mouse = usb_mouse_get(dev_addr);
+  if(!usb_mouse || !usb_mouse->mounted || usb_setup_addr != dev_addr) { return(true); } // Unplugged meanwhile
+
+  usb_setup_next(dev_addr, usb_mouse, result == XFER_RESULT_SUCCESS);
+  return(true);
+}
+
+/*** Settings ***/
+
+// Settings from flash which can change at any time, motion scaling applies from the next report on.
+static void apply_config(void) {
+  options.max_backlog = config.max_backlog;
+  options.sensitivity = config.sensitivity;
+  options.accel_curve = config.accel_curve;
+  options.accel_rate = config.accel_rate;
+  options.accel_limit = config.accel_limit;
+  accel_init(&accel, options.sensitivity, options.accel_curve, options.accel_rate, options.accel_limit);
+}
+
+// Protocol and wheel from config, wheel is a Microsoft extension and nothing else would ever send it.
+static void apply_protocol(void) {
+  options.protocol = config.protocol;
+  options.wheel = (config.protocol == PROTO_MICROSOFT) ? config.wheel : 0;
+}
+
+// Start from the settings built in, then whatever was last saved to flash.
+static void load_config(void) {
+  config_defaults = (config_t){ .version=CONFIG_VERSION, .protocol=options.protocol, .wheel=options.wheel,
+                                .accel_curve=options.accel_curve, .sensitivity=options.sensitivity,
+                                .accel_rate=options.accel_rate, .accel_limit=options.accel_limit,
+                                .max_backlog=options.max_backlog };
+  config = config_defaults;
+  config_load(&config);
+
+  apply_protocol();
+  apply_config();
+}
+
+// When changed settings may be written to flash, once the PC has gone quiet.
+static uint32_t config_save_at(void) {
+  uint32_t last = ((int32_t)(cts_edge_at - rx_seen_at) > 0) ? cts_edge_at : rx_seen_at;
+  return last + CONFIG_SAVE_QUIET_US;
+}
+
+/* Write changed settings to flash. Interrupts are off and core 1 is parked while flash is written, for up to 50ms
+ * when the sector needs erasing, so only do it once the PC has stopped sending and no driver init is under way.
+ * Otherwise received bytes would be lost and a CTS edge answered late. */
+static void config_flush(void) {
+  if(!config_dirty || !time_reached(config_save_at()) || ident_alarm_id != 0) { return; }
+
+  config_save(&config);
+  config_dirty = false;
+}
+
+/*** Idle ***/
+
+/* Sleep until an interrupt or the other core's SEV, or until timeout if timed.
+ * Anything that happens between deciding to sleep and getting here still wakes us, since
+ * interrupts and SEV both latch the event register WFE waits on. */
+static void idle_wait(bool timed, uint32_t timeout) {
+  volatile idle_stats_t *stats = &idle_stats[get_core_num()];
+  uint64_t start = time_us_64();
+
+  if(timed) { best_effort_wfe_or_timeout(from_us_since_boot(start + (int32_t)(timeout - (uint32_t)start))); }
+  else { __wfe(); }
+
+  stats->wakeups++;
+  stats->idle_us += time_us_64() - start;
+}
+
+// Core 0: run the system clock down while there's no driver to serve. The UART's clock follows the
+// system clock, so only switch while the line is quiet and set the baud rate up again straight after.
+static void update_clock(bool slow) {
+  if(!options.idle_khz || slow == slow_clock) { return; }
+
+  uint32_t status = save_and_disable_interrupts();
+  if(serial_tx_idle(uart0)) {
+    set_sys_clock_khz(slow ? options.idle_khz : SYS_CLOCK_KHZ, false);
+    serial_clock_changed(uart0);
+    slow_clock = slow;
+  }
+  restore_interrupts(status);
+}
+
+// Core 1 main, does nothing but USB host handling so enumeration and hub traffic can't hold up serial output.
+void core1_main(void) {
+  multicore_lockout_victim_init(); // Core 0 parks us while writing settings to flash
+  tusb_init(); // USB interrupts are taken by the core which initializes it
+
+  while(1) {
+    tuh_task(); // tinyusb host task
+    hid_task(); // hid/mouse handling
 
-  serial_write(uart0, mouse->state, mouse->update);
+    // Every transfer completes with an interrupt, sleep until one does. A held back report needs us to keep trying.
+    if(!report_held) { idle_wait(false, 0); }
+  }
+}
+
+/*** Mainline mouse state logic ***/
+
+bool serial_tx(mouse_state_t *mouse) {
+  if((mouse->update < 2) && (mouse->force_update == false)) { return(false); } // Minimum report size is 2 (3 bytes)
+  if(serial_tx_space() < MOUSE_PACKET_MAX) { return(false); } // Keep aggregating until the queue has room
+  if(serial_baud_pending()) { return(false); } // Nothing goes out until the line has switched speed
+  int length = mouse_pack(mouse, options.protocol);
+
+  serial_write(uart0, mouse->state, length);
   reset_mouse_state(mouse);
 
   // Update timer target for next transmit
-  // Use variable send rate depending on whether a 3 or 4 byte update was sent
-  if(mouse->update > 2) { txtimer_target = time_us_32() + SERIALDELAY_4B; }
-  else                  { txtimer_target = time_us_32() + SERIALDELAY_3B; }
+  // Next packet is built when the line is about to be free, the transmit queue paces by packet length and line speed
+  txtimer_target = serial_line_free();
+  return(true);
 }
 
-/*void gpio_callback(uint gpio, uint32_t events) {
-  //gpio_event_string(event_str, events);
-  //printf("GPIO %d %s\n", gpio, event_str);
-  if(events & 0x08) {
-    led_state ^= 1; // Flip state between 0/1
-    gpio_put(LED_PIN, led_state);
-    mouse_ident(uart0, options.wheel);
+// Handle data from the PC, baud rate switch commands from the driver and settings commands, see config_command().
+void serial_rx(uart_inst_t* uart) {
+  uint baud;
+  uint8_t byte;
+  while(serial_read(&byte)) {
+    rx_seen_at = time_us_32();
+    baud = baud_command(byte, &baud_star);
+    if(baud) { serial_set_baud(uart, baud); } // Takes effect once what's queued has gone out
+
+    if(config_command(&config_parser, &config, &config_defaults, byte)) {
+      apply_config();
+      config_dirty = true; // Written from the main loop once the line is quiet
+    }
+  }
+}
+
+/*** Driver init detection ***/
+
+// Computers RTS is low -> CTS shows high through the MAX3232. Low -> high -> low is the driver resetting the mouse.
+static void cts_callback(uint gpio, uint32_t events) {
+  if(gpio != UART_CTS_PIN) { return; }
+  absolute_time_t edge = get_absolute_time(); // Timestamp before anything else
+  cts_edge_at = to_us_since_boot(edge);
+
+  if(events & GPIO_IRQ_EDGE_RISE) {
+    if(ident_alarm_id > 0) { cancel_alarm(ident_alarm_id); } // Driver started over before we answered
+    ident_alarm_id = 0;
+    pc_state = CTS_LOW_INIT;
+    serial_discard(); // Driver isn't listening, let the line drain while it holds the mouse in reset
   }
-}*/
+  if((events & GPIO_IRQ_EDGE_FALL) && pc_state == CTS_LOW_INIT && !gpio_get(gpio) && ident_alarm_id == 0) {
+    ident_alarm_id = add_alarm_at(delayed_by_us(edge, IDENT_DELAY_US), ident_alarm, NULL, true);
+  }
+}
+
+// Alarm callback, sends ident a fixed time after the CTS edge no matter what the main loop is doing.
+static int64_t ident_alarm(alarm_id_t id, void *user_data) {
+  (void) id;
+  (void) user_data;
+
+  // Anything still queued is for the previous session. A byte already on the wire can't be taken back though,
+  // line speed and framing only change once it's out or it would be garbled.
+  serial_discard();
+  if(!serial_tx_idle(uart0)) { return(IDENT_RETRY_US); }
+
+  ident_alarm_id = 0;
+  serial_restart(uart0); // Driver starts over at 1200 baud
+
+  // Protocol can only change while the driver is starting over
+  apply_protocol();
+  serial_set_data_bits(uart0, protocol_data_bits(options.protocol));
+
+  mouse_ident(uart0, options.protocol, options.wheel);
+  pc_state = CTS_TOGGLED;
+  ident_count++;
+  return(0); // Don't reschedule
+}
 
 
 /*** Main init & loop ***/
 
 int main() {
+  // Settings saved in flash override the built in ones
+  load_config();
+
   // Initialize serial parameters 
-  mouse_serial_init(uart0); 
+  mouse_serial_init(uart0, protocol_data_bits(options.protocol)); 
 
   // Set up initial state 
-  //enable_pins(UART_RTS_BIT | UART_DTR_BIT);
   reset_mouse_state(&mouse);
 
-  // Initialize USB
-  tusb_init();
+  // USB host lives on core 1
+  report_queue_init(&report_queue);
+  multicore_launch_core1(core1_main);
 
   // Onboard LED
   gpio_init(LED_PIN);
   gpio_set_dir(LED_PIN, GPIO_OUT);
 
-  // CTS Pin
+  // CTS Pin, driver init is caught on its edges
   gpio_init(UART_CTS_PIN); 
   gpio_set_dir(UART_CTS_PIN, GPIO_IN);
-
-  // Button
-  //gpio_init(3); // DEBUG
-  //gpio_set_dir(3, GPIO_IN);
-  //gpio_pull_down(3);
-  //gpio_set_irq_enabled_with_callback(3, GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL, true, &gpio_callback);
+  if(gpio_get(UART_CTS_PIN)) { pc_state = CTS_LOW_INIT; } // Driver already holding the mouse in reset
+  gpio_set_irq_enabled_with_callback(UART_CTS_PIN, GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL, true, &cts_callback);
 
   // Set initial serial transmit timer target
-  txtimer_target = time_us_32() + SERIALDELAY_3B; 
+  txtimer_target = time_us_32() + packet_time(3); 
 
-  mouse.pc_state = CTS_UNINIT;
+  uint32_t ident_seen = 0;
 
   while(1) {
-    bool cts_pin = gpio_get(UART_CTS_PIN);
+    mouse_report_t report;
 
-    // ### Check if mouse driver trying to initialize
-    if(cts_pin) { // Computers RTS is low, with MAX3232 this shows reversed as high instead? Check spec.
-      mouse.pc_state = CTS_LOW_INIT;
-      gpio_put(LED_PIN, false);
+    // ### Take in everything core 1 has received, motion from before ident is discarded below
+    while(report_queue_pop(&report_queue, &report)) {
+      process_mouse_report(&mouse, &report);
     }
 
-    // ### Mouse initiaizing request detected
-    if(!cts_pin && mouse.pc_state == CTS_LOW_INIT) {
-      mouse.pc_state = CTS_TOGGLED;
-      mouse_ident(uart0, options.wheel);
+    // ### Ident was sent, start the session from the current button state without motion from before the driver was listening
+    if(ident_seen != ident_count) {
+      ident_seen = ident_count;
+      mouse.x = mouse.y = mouse.wheel = 0;
+      mouse.mmb_sent = 0; // New driver session starts with the middle button up
+      reset_mouse_state(&mouse);
+      txtimer_target = serial_line_free();
     }
 
+    serial_rx(uart0); // Commands from PC, settings can be changed without a mouse driver running
+    serial_baud_update(uart0);
+    config_flush();
+
     /*** Mouse update loop ***/
-    if(mouse.pc_state == CTS_TOGGLED) {
+    if(pc_state == CTS_TOGGLED && ident_seen) {
       //led_state ^= 1; // Flip state between 0/1 // DEBUG
       gpio_put(LED_PIN, true);
 
-      tuh_task(); // tinyusb host task
-      hid_task(); // hid/mouse handling
-
       if(time_reached(txtimer_target) || mouse.force_update) {
-	serial_tx(&mouse);
+        // Don't let a packet from before a new ident slip out after it
+        uint32_t status = save_and_disable_interrupts();
+        if(ident_seen == ident_count && pc_state == CTS_TOGGLED) { serial_tx(&mouse); }
+        restore_interrupts(status);
       }
+    }
+    else {
+      gpio_put(LED_PIN, false);
+    }
+
+    // ### Clock down while the PC is off or hasn't loaded a driver, ident still goes out on time at the lower clock
+    update_clock(pc_state != CTS_TOGGLED);
 
+    // ### Sleep until core 1 has a report, the PC sends something, CTS changes or the next packet is due
+    if(report_queue_empty(&report_queue) && !serial_rx_ready()) {
+      bool due = (pc_state == CTS_TOGGLED) && (mouse.update >= 2 || mouse.force_update);
+      if(serial_baud_pending()) { idle_wait(true, serial_line_free()); } // Switch speed as soon as the line is idle
+      else if(due && !time_reached(txtimer_target)) { idle_wait(true, txtimer_target); }
+      else if(config_dirty) { idle_wait(true, config_save_at()); } // Wake up to save settings
+      else if(!due || serial_tx_space() < MOUSE_PACKET_MAX) { idle_wait(false, 0); } // Room in the transmit queue comes with an interrupt
     }
     //sleep_us(1);
   }
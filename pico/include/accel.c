@@ -0,0 +1,68 @@
+/*
+ * Anachro Mouse, a usb to serial mouse adaptor. Copyright (C) 2021 Aviancer <oss+amouse@skyvian.me>
+ *
+ * This library is free software; you can redistribute it and/or modify it under the terms of the 
+ * GNU Lesser General Public License as published by the Free Software Foundation; either version 
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without 
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the 
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along with this library; 
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "accel.h"
+
+// Curve from its name, -1 if unknown.
+int accel_curve(const char *name) {
+  if(strcmp(name, "flat") == 0) { return ACCEL_FLAT; }
+  if(strcmp(name, "linear") == 0) { return ACCEL_LINEAR; }
+  if(strcmp(name, "quadratic") == 0) { return ACCEL_QUADRATIC; }
+  return -1;
+}
+
+/* Fill in the gain table. Sensitivity, rate and limit are percentages: sensitivity 200 doubles all motion,
+ * rate 10 adds 10% gain per count of speed (per count squared / 8 for quadratic) and limit caps the
+ * acceleration at limit% of sensitivity. Float free, this runs on the Pico too. */
+void accel_init(accel_t *accel, int sensitivity, int curve, int rate, int limit) {
+  int64_t boost; // Acceleration in percent
+
+  for(int speed=0; speed < ACCEL_LUT_SIZE; speed++) {
+    switch(curve) {
+      case ACCEL_LINEAR:    boost = 100 + (int64_t)rate * speed; break;
+      case ACCEL_QUADRATIC: boost = 100 + (int64_t)rate * speed * speed / 8; break;
+      default:              boost = 100; break;
+    }
+    if(limit >= 100 && boost > limit) { boost = limit; }
+    accel->gain[speed] = (int64_t)sensitivity * boost * ACCEL_ONE / 10000;
+  }
+  accel->remainder_x = 0;
+  accel->remainder_y = 0;
+}
+
+static int scale_axis(int value, uint32_t gain, int32_t *remainder) {
+  int32_t scaled;
+  int result;
+
+  if((value < 0 && *remainder > 0) || (value > 0 && *remainder < 0)) { *remainder = 0; } // Changed direction
+  scaled = value * (int32_t)gain + *remainder;
+  result = scaled / ACCEL_ONE; // Towards zero, both directions round the same way
+  *remainder = scaled - result * ACCEL_ONE;
+  return result;
+}
+
+// Scale the motion of one report in place.
+void accel_apply(accel_t *accel, int *x, int *y) {
+  int ax = abs(*x), ay = abs(*y);
+  int speed = ax > ay ? ax + ay / 2 : ay + ax / 2; // Cheap approximation of vector length
+
+  if(speed >= ACCEL_LUT_SIZE) { speed = ACCEL_LUT_SIZE - 1; }
+  *x = scale_axis(*x, accel->gain[speed], &accel->remainder_x);
+  *y = scale_axis(*y, accel->gain[speed], &accel->remainder_y);
+}
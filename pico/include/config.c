@@ -0,0 +1,153 @@
+/*
+ * Anachro Mouse, a usb to serial mouse adaptor. Copyright (C) 2021 Aviancer <oss+amouse@skyvian.me>
+ *
+ * This library is free software; you can redistribute it and/or modify it under the terms of the 
+ * GNU Lesser General Public License as published by the Free Software Foundation; either version 
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without 
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the 
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along with this library; 
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+*/
+
+#include <string.h>
+#include "pico/stdlib.h"
+#include "pico/multicore.h"
+#include "hardware/flash.h"
+#include "hardware/sync.h"
+
+#include "config.h"
+#include "mouse.h"
+#include "accel.h"
+
+#define CONFIG_FLASH_OFFSET (PICO_FLASH_SIZE_BYTES - FLASH_SECTOR_SIZE) // Last sector
+#define CONFIG_SLOTS (FLASH_SECTOR_SIZE / CONFIG_SLOT_SIZE)
+
+typedef struct config_record {
+  uint32_t magic; // CONFIG_MAGIC, all ones for a slot never written
+  config_t config;
+  uint32_t checksum;
+} config_record_t;
+
+_Static_assert(sizeof(config_record_t) <= CONFIG_SLOT_SIZE, "config record doesn't fit its slot");
+_Static_assert(FLASH_PAGE_SIZE % CONFIG_SLOT_SIZE == 0, "config slots must not straddle pages");
+
+static int next_slot = -1; // Where the next save goes, CONFIG_SLOTS when the sector is full
+
+static const config_record_t *config_slot(int slot) {
+  return (const config_record_t *)(XIP_BASE + CONFIG_FLASH_OFFSET + slot * CONFIG_SLOT_SIZE);
+}
+
+// FNV-1a over the settings, catches records torn by losing power while writing
+static uint32_t config_checksum(const config_t *config) {
+  const uint8_t *bytes = (const uint8_t *)config;
+  uint32_t hash = 2166136261u;
+  for(unsigned int i=0; i < sizeof(*config); i++) {
+    hash = (hash ^ bytes[i]) * 16777619u;
+  }
+  return hash;
+}
+
+// Load the newest good record, returns false and leaves config as is if there's none.
+bool config_load(config_t *config) {
+  const config_record_t *found = NULL;
+  int slot;
+
+  for(slot=0; slot < CONFIG_SLOTS; slot++) {
+    const config_record_t *record = config_slot(slot);
+    if(record->magic == 0xFFFFFFFF) { break; } // Erased, nothing written past here
+    if(record->magic == CONFIG_MAGIC && record->config.version == CONFIG_VERSION &&
+       record->checksum == config_checksum(&record->config)) {
+      found = record;
+    }
+  }
+  next_slot = slot;
+
+  if(!found) { return(false); }
+  *config = found->config;
+  return(true);
+}
+
+/* Append a record, erasing the sector first once it's full. Flash can't be read while it's being written,
+ * so core 1 is parked and interrupts are off for the duration: about 1ms, or 50ms when erasing. */
+bool config_save(const config_t *config) {
+  uint8_t page[FLASH_PAGE_SIZE];
+  config_record_t record;
+
+  if(next_slot < 0) { config_t scratch; config_load(&scratch); } // Find the end of the log
+  bool erase = (next_slot >= CONFIG_SLOTS);
+  if(erase) { next_slot = 0; }
+
+  memset(&record, 0xFF, sizeof(record));
+  record.magic = CONFIG_MAGIC;
+  record.config = *config;
+  record.checksum = config_checksum(&record.config);
+
+  // Programming only clears bits, so the rest of the page left as ones is untouched
+  uint32_t offset = next_slot * CONFIG_SLOT_SIZE;
+  uint32_t page_offset = offset & ~(FLASH_PAGE_SIZE - 1);
+  memset(page, 0xFF, sizeof(page));
+  memcpy(page + (offset - page_offset), &record, sizeof(record));
+
+  multicore_lockout_start_blocking();
+  uint32_t status = save_and_disable_interrupts();
+  if(erase) { flash_range_erase(CONFIG_FLASH_OFFSET, FLASH_SECTOR_SIZE); }
+  flash_range_program(CONFIG_FLASH_OFFSET + page_offset, page, FLASH_PAGE_SIZE);
+  restore_interrupts(status);
+  multicore_lockout_end_blocking();
+
+  next_slot++;
+  return(memcmp(config_slot(next_slot - 1), &record, sizeof(record)) == 0);
+}
+
+static bool config_set(config_t *config, const config_t *defaults, char setting, int value) {
+  switch(setting) {
+    case 'P': if(value < PROTO_MICROSOFT || value > PROTO_LOGITECH) { return(false); }
+              config->protocol = value; break;
+    case 'W': config->wheel = (value != 0); break;
+    case 'S': if(value < 1 || value > 1000) { return(false); }
+              config->sensitivity = value; break;
+    case 'A': if(value < ACCEL_FLAT || value > ACCEL_QUADRATIC) { return(false); }
+              config->accel_curve = value; break;
+    case 'R': if(value < 0 || value > 1000) { return(false); }
+              config->accel_rate = value; break;
+    case 'L': if(value < 0 || value > 10000) { return(false); }
+              config->accel_limit = value; break;
+    case 'B': if(value < -1 || value > 1000) { return(false); }
+              config->max_backlog = value; break;
+    case 'D': *config = *defaults; break; // Back to what the firmware was built with
+    default: return(false);
+  }
+  return(true);
+}
+
+/* Settings commands from the PC, one per line: '!' then a letter and a number, e.g. "!S150".
+ *   P protocol (0 Microsoft, 1 Mouse Systems, 2 Logitech)  W wheel (0/1)  S sensitivity %
+ *   A accel curve (0 flat, 1 linear, 2 quadratic)  R accel rate %  L accel limit %
+ *   B max backlog (-1 unlimited)  D back to defaults
+ * Mouse drivers never send '!', so this doesn't get in the way of baud rate commands.
+ * Returns true when a line changed the settings. */
+bool config_command(config_parser_t *parser, config_t *config, const config_t *defaults, uint8_t byte) {
+  if(byte == '!') {
+    memset(parser, 0, sizeof(*parser));
+    parser->active = true;
+    return(false);
+  }
+  if(!parser->active) { return(false); }
+
+  if(byte == '\r' || byte == '\n') {
+    parser->active = false;
+    return(config_set(config, defaults, parser->setting, parser->negative ? -parser->value : parser->value));
+  }
+
+  if(!parser->setting && byte >= 'a' && byte <= 'z') { byte -= 'a' - 'A'; }
+  if(!parser->setting && byte >= 'A' && byte <= 'Z') { parser->setting = byte; }
+  else if(parser->setting && byte == '-' && !parser->value) { parser->negative = true; }
+  else if(parser->setting && byte >= '0' && byte <= '9' && parser->value < 100000) { parser->value = parser->value * 10 + (byte - '0'); }
+  else if(byte != ' ') { parser->active = false; } // Not a command after all
+  return(false);
+}
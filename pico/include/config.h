@@ -0,0 +1,56 @@
+/*
+ * Anachro Mouse, a usb to serial mouse adaptor. Copyright (C) 2021 Aviancer <oss+amouse@skyvian.me>
+ *
+ * This library is free software; you can redistribute it and/or modify it under the terms of the 
+ * GNU Lesser General Public License as published by the Free Software Foundation; either version 
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without 
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the 
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along with this library; 
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+*/
+
+#ifndef CONFIG_H_   /* Include guard */
+#define CONFIG_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Settings kept in the last flash sector so adaptors can be tuned without reflashing.
+ * Each save appends a record to the sector and the newest good one wins, the sector is only
+ * erased once it's full. Loading is a scan over at most CONFIG_SLOTS records in XIP flash. */
+#define CONFIG_SLOT_SIZE 32
+#define CONFIG_MAGIC 0x67664D41 // "AMfg"
+#define CONFIG_VERSION 1
+
+// Settings which can be changed at runtime
+typedef struct config {
+  uint8_t version;
+  uint8_t protocol;
+  uint8_t wheel;
+  uint8_t accel_curve;
+  uint16_t sensitivity; // Percent
+  uint16_t accel_rate;  // Percent per count of speed
+  uint16_t accel_limit; // Percent, 0 for none
+  int16_t max_backlog;  // -1 for unlimited
+} config_t;
+
+// Commands from the PC look like "!S150" followed by CR or LF, see config_command()
+typedef struct config_parser {
+  bool active;   // Seen '!'
+  char setting;  // Letter after it
+  bool negative;
+  int value;
+} config_parser_t;
+
+bool config_load(config_t *config);
+
+bool config_save(const config_t *config);
+
+bool config_command(config_parser_t *parser, config_t *config, const config_t *defaults, uint8_t byte);
+
+#endif // CONFIG_H_
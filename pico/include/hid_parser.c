@@ -0,0 +1,226 @@
+/*
+ * Anachro Mouse, a usb to serial mouse adaptor. Copyright (C) 2021 Aviancer <oss+amouse@skyvian.me>
+ *
+ * This library is free software; you can redistribute it and/or modify it under the terms of the 
+ * GNU Lesser General Public License as published by the Free Software Foundation; either version 
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without 
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the 
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along with this library; 
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "hid_parser.h"
+
+// Report descriptor short item types and tags, see the USB HID 1.11 spec section 6.2.2
+enum HID_ITEM_TYPES { HID_TYPE_MAIN = 0, HID_TYPE_GLOBAL = 1, HID_TYPE_LOCAL = 2 };
+
+enum HID_MAIN_TAGS   { HID_INPUT = 0x8, HID_OUTPUT = 0x9, HID_COLLECTION = 0xA, HID_FEATURE = 0xB, HID_END_COLLECTION = 0xC };
+enum HID_GLOBAL_TAGS { HID_USAGE_PAGE = 0x0, HID_LOGICAL_MIN = 0x1, HID_REPORT_SIZE = 0x7, HID_REPORT_ID = 0x8, HID_REPORT_COUNT = 0x9 };
+enum HID_LOCAL_TAGS  { HID_USAGE = 0x0, HID_USAGE_MIN = 0x1, HID_USAGE_MAX = 0x2 };
+
+#define HID_INPUT_CONSTANT 0x01
+#define HID_INPUT_VARIABLE 0x02
+#define HID_INPUT_RELATIVE 0x04
+#define HID_COLLECTION_APPLICATION 0x01
+
+// Usages we care about, page << 16 | usage
+#define HID_PAGE_DESKTOP 0x01
+#define HID_PAGE_BUTTON  0x09
+#define HID_USAGE_MOUSE  0x00010002
+#define HID_USAGE_X      0x00010030
+#define HID_USAGE_Y      0x00010031
+#define HID_USAGE_WHEEL  0x00010038
+
+#define HID_MAX_USAGES 16 // Usages listed before a single main item
+#define HID_MAX_IDS 16    // Report IDs we keep bit offsets for, mice use few of them
+
+// Bits so far in one report
+typedef struct hid_report_bits {
+  uint8_t report_id;
+  uint16_t bits;
+} hid_report_bits_t;
+
+// Returns false for fields we can't read, empty ones or ones ending past the longest report we take.
+static bool set_field(hid_field_t *field, uint32_t bit, uint32_t size, bool is_signed) {
+  if(size == 0 || bit + size > HID_REPORT_MAX * 8) { return(false); }
+  if(size > HID_FIELD_MAX_BITS) { size = HID_FIELD_MAX_BITS; }
+  field->byte = bit / 8;
+  field->shift = bit % 8;
+  field->mask = (size < 32) ? (1UL << size) - 1 : 0xFFFFFFFF;
+  field->sign = is_signed ? 1UL << (size - 1) : 0;
+  return(true);
+}
+
+// Bit count of report_id, added to the table if it's new. NULL once the table is full.
+static uint16_t *report_bits(hid_report_bits_t *table, int *count, uint8_t report_id) {
+  for(int n=0; n < *count; n++) {
+    if(table[n].report_id == report_id) { return(&table[n].bits); }
+  }
+  if(*count >= HID_MAX_IDS) { return(NULL); }
+  table[*count].report_id = report_id;
+  table[*count].bits = 0;
+  return(&table[(*count)++].bits);
+}
+
+// Layout of the boot protocol report, what mice use until told otherwise.
+void hid_plan_boot(hid_plan_t *plan) {
+  memset(plan, 0, sizeof(*plan));
+  set_field(&plan->buttons, 0, 8, false);
+  set_field(&plan->x, 8, 8, true);
+  set_field(&plan->y, 16, 8, true);
+  set_field(&plan->wheel, 24, 8, true);
+}
+
+/* Build a plan from a report descriptor, for mice running in report protocol.
+ * Takes the first report ID with relative X and Y inside a Mouse application collection.
+ * Returns false if there's no such report, its mouse fields are empty or lie past HID_REPORT_MAX, or there are
+ * more than HID_MAX_IDS reports. The plan is left as it was then. */
+bool hid_plan_parse(hid_plan_t *plan, const uint8_t *desc, int length) {
+  uint32_t usage_page = 0, report_size = 0, report_count = 0;
+  int32_t logical_min = 0;
+  uint8_t report_id = 0;
+  uint32_t usages[HID_MAX_USAGES];
+  int usage_count = 0;
+  uint32_t usage_min = 0, usage_max = 0;
+  hid_report_bits_t bits[HID_MAX_IDS]; // Bits so far in each report, by ID
+  int id_count = 0;
+  int depth = 0, mouse_depth = -1;  // Collection nesting, and where the Mouse application started
+  bool found = false;
+
+  hid_plan_t parsed;
+  memset(&parsed, 0, sizeof(parsed));
+
+  for(int i=0; i < length; ) {
+    uint8_t prefix = desc[i++];
+    if(prefix == 0xFE) { // Long item, never used for anything we need
+      if(i + 1 < length) { i += 2 + desc[i]; }
+      else { break; }
+      continue;
+    }
+
+    int size = (prefix & 0x03) == 3 ? 4 : (prefix & 0x03);
+    int type = (prefix >> 2) & 0x03;
+    int tag = prefix >> 4;
+    if(i + size > length) { break; }
+
+    uint32_t value = 0;
+    for(int b=0; b < size; b++) { value |= (uint32_t)desc[i + b] << (8 * b); }
+    int32_t svalue = value; // Sign extended version for logical minimum
+    if(size == 1) { svalue = (int8_t)value; }
+    else if(size == 2) { svalue = (int16_t)value; }
+    i += size;
+
+    if(type == HID_TYPE_GLOBAL) {
+      switch(tag) {
+        case HID_USAGE_PAGE:   usage_page = value; break;
+        case HID_LOGICAL_MIN:  logical_min = svalue; break;
+        case HID_REPORT_SIZE:  report_size = value; break;
+        case HID_REPORT_COUNT: report_count = value; break;
+        case HID_REPORT_ID:    report_id = value; break;
+      }
+      continue;
+    }
+
+    if(type == HID_TYPE_LOCAL) {
+      if(size < 4) { value |= usage_page << 16; } // Short usages are on the current page
+      switch(tag) {
+        case HID_USAGE:     if(usage_count < HID_MAX_USAGES) { usages[usage_count++] = value; } break;
+        case HID_USAGE_MIN: usage_min = value; break;
+        case HID_USAGE_MAX: usage_max = value; break;
+      }
+      continue;
+    }
+
+    if(type != HID_TYPE_MAIN) { continue; }
+
+    switch(tag) {
+      case HID_COLLECTION:
+        depth++;
+        if(mouse_depth < 0 && value == HID_COLLECTION_APPLICATION && usage_count && usages[0] == HID_USAGE_MOUSE) {
+          mouse_depth = depth;
+        }
+        break;
+
+      case HID_END_COLLECTION:
+        if(depth == mouse_depth) { mouse_depth = -1; }
+        if(depth > 0) { depth--; }
+        break;
+
+      case HID_INPUT: {
+        uint16_t *offset = report_bits(bits, &id_count, report_id);
+        if(!offset) { return(false); } // More reports than we can keep track of
+        bool wanted = (mouse_depth >= 0) && !(value & HID_INPUT_CONSTANT) && (value & HID_INPUT_VARIABLE) &&
+                      (!found || report_id == parsed.report_id);
+        uint32_t base = report_id ? 8 : 0; // Report ID byte comes first when IDs are used
+
+        for(uint32_t n=0; wanted && n < report_count; n++) {
+          uint32_t usage;
+          if(usage_count) { usage = usages[n < (uint32_t)usage_count ? n : (uint32_t)usage_count - 1]; }
+          else { usage = usage_min + n; }
+          if(usage_max && usage > usage_max) { break; }
+
+          uint32_t bit = base + *offset + n * report_size;
+          bool is_signed = logical_min < 0;
+
+          if((usage >> 16) == HID_PAGE_BUTTON && report_size == 1) {
+            uint32_t button = (usage & 0xFFFF) - 1;
+            if(button == 0 && !set_field(&parsed.buttons, bit, report_count - n > 8 ? 8 : report_count - n, false)) {
+              return(false);
+            }
+          }
+          else if(usage == HID_USAGE_X && (value & HID_INPUT_RELATIVE)) {
+            if(!set_field(&parsed.x, bit, report_size, is_signed)) { return(false); }
+            parsed.report_id = report_id;
+            found = true;
+          }
+          else if(usage == HID_USAGE_Y && (value & HID_INPUT_RELATIVE)) {
+            if(!set_field(&parsed.y, bit, report_size, is_signed)) { return(false); }
+          }
+          else if(usage == HID_USAGE_WHEEL && (value & HID_INPUT_RELATIVE)) {
+            if(!set_field(&parsed.wheel, bit, report_size, is_signed)) { return(false); }
+          }
+        }
+        *offset += report_size * report_count;
+        break;
+      }
+    }
+    // Locals only last until the next main item
+    usage_count = 0;
+    usage_min = usage_max = 0;
+  }
+
+  if(!found || !parsed.y.mask) { return(false); }
+  *plan = parsed;
+  return(true);
+}
+
+static inline int32_t get_field(const hid_field_t *field, const uint8_t *report, int length) {
+  uint32_t raw = 0;
+  if(!field->mask) { return(0); }
+
+  // Field is at most 24 bits at a shift of at most 7, so 4 bytes always cover it. Bytes past the report read as 0
+  for(int b=0; b < 4 && field->byte + b < length; b++) { raw |= (uint32_t)report[field->byte + b] << (8 * b); }
+  raw = (raw >> field->shift) & field->mask;
+  if(raw & field->sign) { raw |= ~field->mask; } // Sign extend
+  return((int32_t)raw);
+}
+
+// Pull motion and buttons out of a report. Returns false if the report isn't the one carrying the mouse.
+bool hid_plan_decode(const hid_plan_t *plan, const uint8_t *report, int length,
+                     int *x, int *y, int *wheel, uint8_t *buttons) {
+  if(plan->report_id && (length < 1 || report[0] != plan->report_id)) { return(false); }
+
+  *x = get_field(&plan->x, report, length);
+  *y = get_field(&plan->y, report, length);
+  *wheel = get_field(&plan->wheel, report, length);
+  *buttons = get_field(&plan->buttons, report, length);
+  return(true);
+}
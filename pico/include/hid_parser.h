@@ -0,0 +1,49 @@
+/*
+ * Anachro Mouse, a usb to serial mouse adaptor. Copyright (C) 2021 Aviancer <oss+amouse@skyvian.me>
+ *
+ * This library is free software; you can redistribute it and/or modify it under the terms of the 
+ * GNU Lesser General Public License as published by the Free Software Foundation; either version 
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without 
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the 
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along with this library; 
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+*/
+
+#ifndef HID_PARSER_H_   /* Include guard */
+#define HID_PARSER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Mouse reports are decoded with a plan built from the report descriptor once, when the mouse is mounted.
+ * Decoding a report is then a few shifts and masks per field, whatever the layout, report ID or delta size. */
+#define HID_REPORT_MAX 64  // Longest report we take, one full speed interrupt packet
+#define HID_FIELD_MAX_BITS 24 // Wider fields are read as their low 24 bits
+
+// Where to find one value in a report
+typedef struct hid_field {
+  uint8_t byte;    // Byte offset, report ID included. Fields all end within HID_REPORT_MAX
+  uint8_t shift;   // Bit offset within that byte
+  uint32_t mask;   // Value bits after shifting, 0 if the mouse doesn't have this field
+  uint32_t sign;   // Sign bit for signed fields, 0 for unsigned
+} hid_field_t;
+
+typedef struct hid_plan {
+  uint8_t report_id; // Report ID carrying the mouse, 0 if the device doesn't use IDs
+  hid_field_t x, y, wheel;
+  hid_field_t buttons; // Up to 8 buttons, bit 0 left, 1 right, 2 middle, 3 back, 4 forward
+} hid_plan_t;
+
+void hid_plan_boot(hid_plan_t *plan);
+
+bool hid_plan_parse(hid_plan_t *plan, const uint8_t *desc, int length);
+
+bool hid_plan_decode(const hid_plan_t *plan, const uint8_t *report, int length,
+                     int *x, int *y, int *wheel, uint8_t *buttons);
+
+#endif // HID_PARSER_H_
@@ -0,0 +1,161 @@
+/*
+ * Anachro Mouse, a usb to serial mouse adaptor. Copyright (C) 2021 Aviancer <oss+amouse@skyvian.me>
+ *
+ * This library is free software; you can redistribute it and/or modify it under the terms of the 
+ * GNU Lesser General Public License as published by the Free Software Foundation; either version 
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without 
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the 
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along with this library; 
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "utils.h"
+#include "mouse.h"
+
+static const uint8_t init_mouse_state[] = {0x40, 0x00, 0x00, 0x00, 0x00}; // Our basic Microsoft packet (We send 3 or 4 bytes of it)
+
+/*** Mouse state & packets ***/
+
+// Character size used on the line by each protocol.
+int protocol_data_bits(int protocol) {
+  if(protocol == PROTO_MOUSESYSTEMS) { return 8; }
+  return 7;
+}
+
+// Most X/Y motion a single packet of protocol can carry.
+int protocol_motion_max(int protocol) {
+  if(protocol == PROTO_MOUSESYSTEMS) { return MOUSESYS_MOTION_MAX; }
+  return MOUSE_MOTION_MAX;
+}
+
+// Most motion we may hold on to, a packets worth plus backlog.
+int max_motion(int max_backlog, int packet_max) {
+  if(max_backlog < 0) { return -1; } // No limit
+  return packet_max + max_backlog;
+}
+
+// Motion in accum beyond what one packet of packet_max can carry.
+static int motion_overflow(int accum, int packet_max) {
+  int over = abs(accum) - packet_max;
+  return (over > 0) ? over : 0;
+}
+
+/* Adds delta to an aggregated axis. Motion that won't fit the next packet is counted as carried once, when it
+ * arrives, and anything beyond max (packet plus backlog) is dropped. */
+static void add_axis(mouse_state_t *mouse, int *accum, int delta, int packet_max, int max) {
+  int before = *accum;
+  int over_before = motion_overflow(before, packet_max);
+  int over_after;
+
+  *accum += delta;
+  mouse->motion_dropped += cap_motion(accum, max);
+  over_after = motion_overflow(*accum, packet_max);
+
+  if((before < 0) != (*accum < 0)) { over_before = 0; } // Direction flipped, earlier backlog was cancelled out
+  if(over_after > over_before) { mouse->motion_carried += over_after - over_before; }
+}
+
+// Adds X/Y motion to the aggregation window, packet_max being what one packet carries and max_backlog as in options.
+void mouse_add_motion(mouse_state_t *mouse, int x, int y, int packet_max, int max_backlog) {
+  int max = max_motion(max_backlog, packet_max);
+  add_axis(mouse, &mouse->x, x, packet_max, max);
+  add_axis(mouse, &mouse->y, y, packet_max, max);
+}
+
+// Make sure we don't clobber higher update requests with lower ones.
+void push_update(mouse_state_t *mouse, int full_packet) {
+  if(full_packet || (mouse->update == 3)) { mouse->update = 3; }
+  else { mouse->update = 2; }
+}
+
+// Microsoft protocol, 3 bytes with optional 4th for middle button & wheel.
+static int pack_microsoft(mouse_state_t *mouse) {
+  int movement;
+
+  // Take what fits in this packet, anything beyond is sent with the following ones.
+  int x = take_motion(&mouse->x, MOUSE_MOTION_MAX);
+  int y = take_motion(&mouse->y, MOUSE_MOTION_MAX);
+  int wheel = take_motion(&mouse->wheel, MOUSE_WHEEL_MAX);
+
+  // Set mouse button states
+  mouse->state[0] |= (mouse->lmb << MOUSE_LMB_BIT);
+  mouse->state[0] |= (mouse->rmb << MOUSE_RMB_BIT);
+  mouse->state[3] |= (mouse->mmb << MOUSE_MMB_BIT);
+
+  // Update aggregated mouse movement state
+  movement = x & 0xc0; // Get 2 upper bits of X movement
+  mouse->state[0] = mouse->state[0] | (movement >> 6); // Sets bit based on ev.value, 8th bit to 2nd bit (Discards bits)
+  mouse->state[1] = mouse->state[1] | (x & 0x3f);
+
+  movement = y & 0xc0; // Get 2 upper bits of Y movement
+  mouse->state[0] = mouse->state[0] | (movement >> 4);
+  mouse->state[2] = mouse->state[2] | (y & 0x3f);
+
+  mouse->state[3] = mouse->state[3] | (-wheel & 0x0f); // 127(negatives) when scrolling up, 1(positives) when scrolling down.
+
+  return mouse->update + 1;
+}
+
+/* Logitech 3 button protocol, Microsoft packet with a 4th byte only when the middle button changes.
+ * 3 button drivers without wheel support get the middle button without paying for 4 byte packets. */
+static int pack_logitech(mouse_state_t *mouse) {
+  int mmb = mouse->mmb;
+
+  mouse->mmb = 0; // Middle button goes into a 4th byte of its own, not the IntelliMouse bit.
+  pack_microsoft(mouse);
+  mouse->mmb = mmb;
+
+  if(mmb == mouse->mmb_sent) { return 3; }
+  mouse->state[3] = (mmb << LOGITECH_MMB_BIT);
+  mouse->mmb_sent = mmb;
+  return 4;
+}
+
+/* Mouse Systems protocol, sync byte with buttons followed by two X/Y deltas.
+ * Aggregated motion is split across both deltas so the driver moves the cursor in two smaller steps. */
+static int pack_mousesystems(mouse_state_t *mouse) {
+  int x = take_motion(&mouse->x, MOUSESYS_MOTION_MAX);
+  int y = -take_motion(&mouse->y, MOUSESYS_MOTION_MAX); // Positive Y is up
+  int x1 = x / 2;
+  int y1 = y / 2;
+
+  mouse->state[0] = 0x80 | 0x07; // Sync bits, all buttons up
+  mouse->state[0] &= ~(mouse->lmb << MOUSESYS_LMB_BIT);
+  mouse->state[0] &= ~(mouse->mmb << MOUSESYS_MMB_BIT);
+  mouse->state[0] &= ~(mouse->rmb << MOUSESYS_RMB_BIT);
+
+  mouse->state[1] = (uint8_t)x1;
+  mouse->state[2] = (uint8_t)y1;
+  mouse->state[3] = (uint8_t)(x - x1);
+  mouse->state[4] = (uint8_t)(y - y1);
+
+  return 5;
+}
+
+// Packs aggregated mouse state into mouse->state, returns length of the packet.
+int mouse_pack(mouse_state_t *mouse, int protocol) {
+  if(protocol != PROTO_MICROSOFT) { mouse->wheel = 0; } // Only the IntelliMouse extension has a wheel byte
+  if(protocol == PROTO_MOUSESYSTEMS) { return pack_mousesystems(mouse); }
+  if(protocol == PROTO_LOGITECH)     { return pack_logitech(mouse); }
+  return pack_microsoft(mouse);
+}
+
+// Reset packet after it has been sent, start a new aggregation window.
+void reset_mouse_state(mouse_state_t *mouse) {
+  memcpy( mouse->state, init_mouse_state, sizeof(mouse->state) ); // Set packet memory to initial state
+  mouse->update = -1;
+  mouse->force_update = 0;
+  // Do not reset button states here, will be updated on release of buttons.
+  // Motion is not reset either, anything left over is carried to the next packet.
+
+  if(mouse->x || mouse->y) { push_update(mouse, mouse->mmb); }
+  if(mouse->wheel) { push_update(mouse, 1); }
+}
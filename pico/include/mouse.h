@@ -0,0 +1,68 @@
+/*
+ * Anachro Mouse, a usb to serial mouse adaptor. Copyright (C) 2021 Aviancer <oss+amouse@skyvian.me>
+ *
+ * This library is free software; you can redistribute it and/or modify it under the terms of the 
+ * GNU Lesser General Public License as published by the Free Software Foundation; either version 
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without 
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the 
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along with this library; 
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+*/
+
+#ifndef MOUSE_H_   /* Include guard */
+#define MOUSE_H_
+
+/* Protocol definitions */
+#define MOUSE_LMB_BIT 5 // Defines << shift for bit position
+#define MOUSE_RMB_BIT 4
+#define MOUSE_MMB_BIT 4 // Shift 4 times in 4th byte
+#define LOGITECH_MMB_BIT 5 // Logitech 4th byte, only sent when middle button changes
+#define MOUSE_MOTION_MAX 127 // Most X/Y motion a single packet can carry
+#define MOUSE_WHEEL_MAX 7    // Wheel motion is a 4 bit signed value
+#define MOUSESYS_MOTION_MAX (2 * MOUSE_MOTION_MAX) // Mouse Systems packets carry two deltas per axis
+
+// Mouse Systems button bits, active low
+#define MOUSESYS_LMB_BIT 2
+#define MOUSESYS_MMB_BIT 1
+#define MOUSESYS_RMB_BIT 0
+
+#define MOUSE_PACKET_MAX 5 // Longest packet of any protocol
+
+// Mouse protocols we can emulate
+enum MOUSE_PROTOCOLS {
+  PROTO_MICROSOFT    = 0, // Microsoft 3 byte 7n1, 4 byte with IntelliMouse wheel
+  PROTO_MOUSESYSTEMS = 1, // Mouse Systems (PC Systems) 5 byte 8n1, two deltas per packet
+  PROTO_LOGITECH     = 2  // Logitech 3 button, Microsoft 3 byte 7n1 with 4th byte on middle button change
+};
+
+// Struct for storing information about accumulated mouse state
+typedef struct mouse_state {
+  int pc_state; // Current state of mouse driver initialization on PC.
+  uint8_t state[MOUSE_PACKET_MAX]; // Mouse state
+  int x, y, wheel;
+  int update; // How many bytes to send
+  int lmb, rmb, mmb, force_update;
+  int mmb_sent; // Middle button state last sent to PC
+  uint32_t motion_carried, motion_dropped; // Motion which didn't fit in a single packet
+} mouse_state_t;
+
+int protocol_data_bits(int protocol);
+
+int protocol_motion_max(int protocol);
+
+int max_motion(int max_backlog, int packet_max);
+
+void mouse_add_motion(mouse_state_t *mouse, int x, int y, int packet_max, int max_backlog);
+
+void push_update(mouse_state_t *mouse, int full_packet);
+
+int mouse_pack(mouse_state_t *mouse, int protocol);
+
+void reset_mouse_state(mouse_state_t *mouse);
+
+#endif // MOUSE_H_
@@ -0,0 +1,137 @@
+/*
+ * Anachro Mouse, a usb to serial mouse adaptor. Copyright (C) 2021 Aviancer <oss+amouse@skyvian.me>
+ *
+ * This library is free software; you can redistribute it and/or modify it under the terms of the 
+ * GNU Lesser General Public License as published by the Free Software Foundation; either version 
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without 
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the 
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along with this library; 
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+*/
+
+#include "pico/stdlib.h"
+#include "hardware/pio.h"
+#include "hardware/irq.h"
+#include "hardware/clocks.h"
+
+#include "pio_serial.h"
+#include "pio_serial.pio.h"
+
+#define PIO_SERIAL_PIO pio0
+#define PIO_SERIAL_IRQ PIO0_IRQ_0
+
+static pio_serial_t *ports[PIO_SERIAL_MAX_PORTS]; // By state machine
+static int program_offset = -1;
+
+// Frame ends and FIFO room for every port, the program raises IRQ flag <sm> as each stop bit starts.
+static void pio_serial_irq(void) {
+  uint64_t now = time_us_64();
+
+  for(uint sm=0; sm < PIO_SERIAL_MAX_PORTS; sm++) {
+    pio_serial_t *port = ports[sm];
+    if(!port) { continue; }
+
+    if(pio_interrupt_get(port->pio, sm)) {
+      pio_interrupt_clear(port->pio, sm);
+      port->stop_at = now;
+      port->frames_done++;
+    }
+    if(port->room_wanted && !pio_sm_is_tx_fifo_full(port->pio, sm)) {
+      port->on_room(port);
+    }
+  }
+}
+
+static void update_clkdiv(pio_serial_t *port) {
+  float div = (float)clock_get_hz(clk_sys) / (PIO_SERIAL_CYCLES_PER_BIT * port->baud);
+  pio_sm_set_clkdiv(port->pio, port->sm, div);
+  port->bit_us = (1000000 + port->baud - 1) / port->baud;
+}
+
+// Claim a state machine and start transmitting on pin. Returns false if they're all taken.
+bool pio_serial_init(pio_serial_t *port, uint pin, uint baud, uint data_bits, void (*on_room)(pio_serial_t *port)) {
+  PIO pio = PIO_SERIAL_PIO;
+  int sm = pio_claim_unused_sm(pio, false);
+  if(sm < 0) { return(false); }
+
+  if(program_offset < 0) {
+    program_offset = pio_add_program(pio, &pio_serial_tx_program);
+    irq_set_exclusive_handler(PIO_SERIAL_IRQ, pio_serial_irq);
+    irq_set_enabled(PIO_SERIAL_IRQ, true);
+  }
+
+  port->pio = pio;
+  port->sm = sm;
+  port->pin = pin;
+  port->baud = baud;
+  port->data_bits = data_bits;
+  port->on_room = on_room;
+  port->room_wanted = false;
+  port->frames_sent = 0;
+  port->frames_done = 0;
+  port->stop_at = time_us_64();
+  ports[sm] = port;
+
+  pio_serial_tx_program_init(pio, sm, program_offset, pin);
+  update_clkdiv(port);
+  pio_set_irq0_source_enabled(pio, pis_interrupt0 + sm, true);
+  pio_sm_set_enabled(pio, sm, true);
+  return(true);
+}
+
+// Also call this after changing the system clock, the divider is worked out from it.
+void pio_serial_set_baud(pio_serial_t *port, uint baud) {
+  port->baud = baud;
+  update_clkdiv(port);
+}
+
+// Takes effect from the next frame pushed.
+void pio_serial_set_data_bits(pio_serial_t *port, uint data_bits) {
+  port->data_bits = data_bits;
+}
+
+bool pio_serial_writable(pio_serial_t *port) {
+  return(!pio_sm_is_tx_fifo_full(port->pio, port->sm));
+}
+
+// Push one frame, check pio_serial_writable() first.
+void pio_serial_putc(pio_serial_t *port, uint8_t byte) {
+  uint8_t mask = (1u << port->data_bits) - 1;
+  pio_sm_put(port->pio, port->sm, ((uint32_t)(byte & mask) << 4) | (port->data_bits - 1));
+  port->frames_sent++;
+}
+
+// Ask for on_room() to be called while the FIFO has room.
+void pio_serial_room_irq(pio_serial_t *port, bool enabled) {
+  if(!port->on_room) { return; }
+  port->room_wanted = enabled;
+  pio_set_irq0_source_enabled(port->pio, pis_sm0_tx_fifo_not_full + port->sm, enabled);
+}
+
+// When the last frame pushed has finished or will finish, once its stop bit has started.
+uint64_t pio_serial_done_at(pio_serial_t *port) {
+  return(port->stop_at + port->bit_us);
+}
+
+// Frames pushed whose stop bit hasn't started yet, in the FIFO or being shifted out.
+uint32_t pio_serial_pending(pio_serial_t *port) {
+  int32_t pending = port->frames_sent - port->frames_done;
+  return(pending > 0 ? pending : 0);
+}
+
+// Everything pushed has gone out including its stop bit.
+bool pio_serial_idle(pio_serial_t *port) {
+  return((int32_t)(port->frames_sent - port->frames_done) <= 0 && time_us_64() >= pio_serial_done_at(port));
+}
+
+// Drop frames still in the FIFO, the one being shifted out finishes and is still counted until its stop bit.
+// The state machine pulls at most once per frame, far slower than the two register accesses here.
+void pio_serial_discard(pio_serial_t *port) {
+  port->frames_sent -= pio_sm_get_tx_fifo_level(port->pio, port->sm);
+  pio_sm_clear_fifos(port->pio, port->sm);
+}
@@ -0,0 +1,63 @@
+/*
+ * Anachro Mouse, a usb to serial mouse adaptor. Copyright (C) 2021 Aviancer <oss+amouse@skyvian.me>
+ *
+ * This library is free software; you can redistribute it and/or modify it under the terms of the 
+ * GNU Lesser General Public License as published by the Free Software Foundation; either version 
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without 
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the 
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along with this library; 
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+*/
+
+#ifndef PIO_SERIAL_H_   /* Include guard */
+#define PIO_SERIAL_H_
+
+#include "hardware/pio.h"
+
+/* Serial transmitters on PIO state machines, as many as pio0 has (4) alongside or instead of the UARTs.
+ * Any baud rate the clock divider can hit, 7 or 8 data bits, and frames queued together go out with
+ * exactly one stop bit between them. Every frame raises an interrupt as its stop bit starts, which
+ * gives the time the line goes idle to within the interrupt latency. */
+#define PIO_SERIAL_MAX_PORTS 4
+#define PIO_SERIAL_CYCLES_PER_BIT 8 // See pio_serial.pio
+
+typedef struct pio_serial {
+  PIO pio;
+  uint sm;
+  uint pin;
+  uint baud;
+  uint data_bits;
+  uint32_t bit_us;           // Bit time rounded up
+  void (*on_room)(struct pio_serial *port); // Called from the interrupt when the FIFO has room, while asked for
+  volatile bool room_wanted;
+  uint32_t frames_sent;      // Frames pushed to the FIFO
+  volatile uint32_t frames_done;  // Frames whose stop bit has started
+  volatile uint64_t stop_at;      // When the last of those stop bits started
+} pio_serial_t;
+
+bool pio_serial_init(pio_serial_t *port, uint pin, uint baud, uint data_bits, void (*on_room)(pio_serial_t *port));
+
+void pio_serial_set_baud(pio_serial_t *port, uint baud);
+
+void pio_serial_set_data_bits(pio_serial_t *port, uint data_bits);
+
+bool pio_serial_writable(pio_serial_t *port);
+
+void pio_serial_putc(pio_serial_t *port, uint8_t byte);
+
+void pio_serial_room_irq(pio_serial_t *port, bool enabled);
+
+uint64_t pio_serial_done_at(pio_serial_t *port);
+
+uint32_t pio_serial_pending(pio_serial_t *port);
+
+bool pio_serial_idle(pio_serial_t *port);
+
+void pio_serial_discard(pio_serial_t *port);
+
+#endif // PIO_SERIAL_H_
@@ -0,0 +1,56 @@
+/*
+ * Anachro Mouse, a usb to serial mouse adaptor. Copyright (C) 2021 Aviancer <oss+amouse@skyvian.me>
+ *
+ * This library is free software; you can redistribute it and/or modify it under the terms of the 
+ * GNU Lesser General Public License as published by the Free Software Foundation; either version 
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without 
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the 
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along with this library; 
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+*/
+
+#include "pico/stdlib.h"
+#include "hardware/sync.h"
+
+#include "report_queue.h"
+
+void report_queue_init(report_queue_t *queue) {
+  queue->head = 0;
+  queue->tail = 0;
+  queue->received = 0;
+  queue->merged = 0;
+  queue->dropped = 0;
+}
+
+// Producer side, returns false if the queue is full.
+bool report_queue_push(report_queue_t *queue, const mouse_report_t *report) {
+  uint32_t head = queue->head;
+  if(head - queue->tail >= REPORT_QUEUE_SIZE) { return(false); }
+
+  queue->reports[head & (REPORT_QUEUE_SIZE - 1)] = *report;
+  __dmb(); // Report must be visible to the other core before the new head is
+  queue->head = head + 1;
+  __sev(); // Wake the consumer if it's sleeping in WFE
+  return(true);
+}
+
+bool report_queue_empty(report_queue_t *queue) {
+  return(queue->tail == queue->head);
+}
+
+// Consumer side, returns false if the queue is empty.
+bool report_queue_pop(report_queue_t *queue, mouse_report_t *report) {
+  uint32_t tail = queue->tail;
+  if(tail == queue->head) { return(false); }
+
+  __dmb(); // Don't read the report before seeing the head which published it
+  *report = queue->reports[tail & (REPORT_QUEUE_SIZE - 1)];
+  __dmb(); // Finish reading before handing the slot back to the producer
+  queue->tail = tail + 1;
+  return(true);
+}
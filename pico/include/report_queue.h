@@ -0,0 +1,52 @@
+/*
+ * Anachro Mouse, a usb to serial mouse adaptor. Copyright (C) 2021 Aviancer <oss+amouse@skyvian.me>
+ *
+ * This library is free software; you can redistribute it and/or modify it under the terms of the 
+ * GNU Lesser General Public License as published by the Free Software Foundation; either version 
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without 
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the 
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along with this library; 
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+*/
+
+#ifndef REPORT_QUEUE_H_
+#define REPORT_QUEUE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define REPORT_QUEUE_SIZE 64 // Must be a power of two
+
+// Motion and button state from one USB report, as handed from core 1 to core 0
+typedef struct mouse_report {
+  int16_t x, y;
+  int8_t wheel;
+  uint8_t buttons;
+} mouse_report_t;
+
+// Lock-free queue with a single producer (core 1) and a single consumer (core 0).
+// Head and tail run freely and are only ever written by one side each.
+typedef struct report_queue {
+  mouse_report_t reports[REPORT_QUEUE_SIZE];
+  volatile uint32_t head; // Written by producer only
+  volatile uint32_t tail; // Written by consumer only
+  // Counters, written by producer only
+  volatile uint32_t received; // Reports received from USB
+  volatile uint32_t merged;   // Reports merged into an earlier one while the queue was full
+  volatile uint32_t dropped;  // Reports lost to failed transfers or never processed
+} report_queue_t;
+
+void report_queue_init(report_queue_t *queue);
+
+bool report_queue_push(report_queue_t *queue, const mouse_report_t *report);
+
+bool report_queue_empty(report_queue_t *queue);
+
+bool report_queue_pop(report_queue_t *queue, mouse_report_t *report);
+
+#endif // REPORT_QUEUE_H_
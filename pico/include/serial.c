@@ -15,98 +15,337 @@
 */
 
 #include "pico/stdlib.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
 
 #include "serial.h"
-
-// Map for iterating through each bit (index) for pin (value)  
-// Should be updated to reflect UART_..._PIN values.
-const int UART_BITS2PINS[] = {0,1,3,4,5,6};
-const uint UART_BITS2PINS_LENGTH = 6;
+#include "mouse.h"
+#if AMOUSE_PIO_SERIAL
+#include "pio_serial.h"
+#endif
 
 uint8_t pkt_intellimouse_intro[] = {0x4D,0x5A};
+uint8_t pkt_logitech_intro[] = {0x4D,0x33};
 
-#define BAUD_RATE 1200
-#define DATA_BITS 7
+#define BAUD_RATE 1200 // Starting rate, drivers may switch to a higher one later.
 #define STOP_BITS 1
 #define PARITY UART_PARITY_NONE
 
+static uint serial_baud = BAUD_RATE;  // Actual baud rate the UART is running at
+static uint32_t serial_char_us;       // Microseconds per character at current baud rate and framing
+static uint serial_data_bits = 7;     // 7n1 for Microsoft, 8n1 for Mouse Systems
+static volatile uint serial_baud_next; // Rate asked for, switched to once the line is idle. 0 for none
+
+// Transmit queue, filled by serial_write() and emptied into the UART from its TX interrupt.
+static uart_inst_t *serial_uart;
+static uint8_t tx_queue[SERIAL_TX_QUEUE];
+static volatile uint32_t tx_head; // Written by serial_write() only
+static volatile uint32_t tx_tail; // Written by tx_pump() only, with interrupts off outside the IRQ
+#if AMOUSE_PIO_SERIAL
+static uint32_t tx_started_at;    // When the transmitter last started from idle, the PIO times the rest exactly
+#else
+static uint32_t tx_free_at;       // Estimated time the line goes idle, including pacing margin
+#endif
+
+// Receive queue, filled from the RX interrupt so bytes from the PC wake us up and aren't lost while we sleep.
+static uint8_t rx_queue[SERIAL_RX_QUEUE];
+static volatile uint32_t rx_head; // Written by the interrupt only
+static volatile uint32_t rx_tail; // Written by serial_read() only
+
+#if AMOUSE_PIO_SERIAL
+static pio_serial_t pio_tx; // Transmitter on UART_TX_PIN, the UART only receives
+#endif
+
+static void update_char_time(void) {
+  serial_char_us = (U_FULL_SECOND * (1 + serial_data_bits + STOP_BITS + (PARITY != UART_PARITY_NONE))) / serial_baud;
+}
+
 /*** Serial comms ***/
 
-void mouse_serial_init(uart_inst_t* uart) {
+// Transmitter, either the UART itself or a PIO state machine with exact bit timing, see AMOUSE_PIO_SERIAL.
+static inline bool tx_writable(uart_inst_t* uart) {
+#if AMOUSE_PIO_SERIAL
+  return pio_serial_writable(&pio_tx);
+#else
+  return uart_is_writable(uart);
+#endif
+}
+
+static inline void tx_putc(uart_inst_t* uart, uint8_t byte) {
+#if AMOUSE_PIO_SERIAL
+  pio_serial_putc(&pio_tx, byte);
+#else
+  uart_putc_raw(uart, byte);
+#endif
+}
+
+// Ask for an interrupt when the transmitter has room, receive interrupts stay on
+static inline void tx_want_room(uart_inst_t* uart, bool enabled) {
+#if AMOUSE_PIO_SERIAL
+  pio_serial_room_irq(&pio_tx, enabled);
+#else
+  uart_set_irq_enables(uart, true, enabled);
+#endif
+}
+
+// Still shifting out bits
+static inline bool tx_busy(uart_inst_t* uart) {
+#if AMOUSE_PIO_SERIAL
+  return !pio_serial_idle(&pio_tx);
+#else
+  return (uart_get_hw(uart)->fr & UART_UARTFR_BUSY_BITS) != 0;
+#endif
+}
+
+// Line speed or framing changed, the UART has been set up already
+static inline void tx_update_format(void) {
+#if AMOUSE_PIO_SERIAL
+  pio_serial_set_baud(&pio_tx, serial_baud);
+  pio_serial_set_data_bits(&pio_tx, serial_data_bits);
+#endif
+}
+
+// Move queued bytes into the transmitter while it has room. The UART without FIFOs takes one byte at a time,
+// the PIO FIFO a whole packet.
+static void tx_pump(uart_inst_t* uart) {
+  while(tx_tail != tx_head && tx_writable(uart)) {
+    tx_putc(uart, tx_queue[tx_tail & (SERIAL_TX_QUEUE - 1)]);
+    tx_tail++;
+  }
+  // Only ask for a transmit interrupt while there's something left to send
+  tx_want_room(uart, tx_tail != tx_head);
+}
+
+#if AMOUSE_PIO_SERIAL
+static void pio_tx_room(pio_serial_t *port) {
+  (void)port;
+  tx_pump(serial_uart);
+}
+#endif
+
+static void serial_irq(void) {
+  // With FIFOs off the UART holds a single received byte, move it out before the next one arrives
+  while(uart_is_readable(serial_uart)) {
+    uint8_t byte = uart_getc(serial_uart);
+    if(rx_head - rx_tail < SERIAL_RX_QUEUE) {
+      rx_queue[rx_head & (SERIAL_RX_QUEUE - 1)] = byte;
+      rx_head++;
+    }
+  }
+  tx_pump(serial_uart);
+}
+
+void mouse_serial_init(uart_inst_t* uart, uint data_bits) {
     // Set baud for serial device 
-    uart_init(uart, BAUD_RATE);
+    serial_baud = uart_init(uart, BAUD_RATE);
 
+#if !AMOUSE_PIO_SERIAL
     gpio_set_function(UART_TX_PIN, GPIO_FUNC_UART);
+#endif
     gpio_set_function(UART_RX_PIN, GPIO_FUNC_UART);
     
     // Set UART flow control CTS/RTS off 
     uart_set_hw_flow(uart, false, false);
     // Turn off crlf conversion, we want raw output
     uart_set_translate_crlf(uart, false);
-    // 7n1
-    uart_set_format(uart, DATA_BITS, STOP_BITS, PARITY);
+    // 7n1 or 8n1
+    serial_data_bits = data_bits;
+    uart_set_format(uart, serial_data_bits, STOP_BITS, PARITY);
+    update_char_time();
 
     // Having the FIFOs on causes lag with 4 byte packets, this ensures better flow.
     uart_set_fifo_enabled(uart, false);
+
+    // Transmit and receive from interrupt so the main loop never waits on the line
+    serial_uart = uart;
+    tx_head = tx_tail = 0;
+    rx_head = rx_tail = 0;
+#if AMOUSE_PIO_SERIAL
+    tx_started_at = time_us_32();
+#else
+    tx_free_at = time_us_32();
+#endif
+    int irq = (uart_get_index(uart) == 0) ? UART0_IRQ : UART1_IRQ;
+    irq_set_exclusive_handler(irq, serial_irq);
+    irq_set_enabled(irq, true);
+    uart_set_irq_enables(uart, true, false);
+
+#if AMOUSE_PIO_SERIAL
+    pio_serial_init(&pio_tx, UART_TX_PIN, serial_baud, serial_data_bits, pio_tx_room);
+#endif
+}
+
+uint serial_get_baud(void) {
+  return serial_baud;
 }
 
-// TODO: Size does not always match if mixing null terminated and not packets.
+// Change line speed once anything still queued has gone out at the old rate, see serial_baud_update().
+void serial_set_baud(uart_inst_t* uart, uint baud) {
+  serial_baud_next = (baud != serial_baud) ? baud : 0;
+  serial_baud_update(uart);
+}
+
+// Switch to a requested rate if the line has gone idle. Never waits, call again while serial_baud_pending().
+void serial_baud_update(uart_inst_t* uart) {
+  uint32_t status = save_and_disable_interrupts();
+  if(serial_baud_next && serial_tx_idle(uart)) {
+    serial_baud = uart_set_baudrate(uart, serial_baud_next);
+    serial_baud_next = 0;
+    update_char_time();
+    tx_update_format();
+  }
+  restore_interrupts(status);
+}
+
+// A speed change is waiting for the line, nothing new should be queued until it's done.
+bool serial_baud_pending(void) {
+  return(serial_baud_next != 0);
+}
+
+// Time to wait between packets so we never send faster than the line can carry them.
+uint32_t packet_time(int bytes) {
+  uint32_t time = serial_char_us * bytes;
+  return time + (time / SERIAL_PACING_MARGIN);
+}
+
+/* Logitech style baud rate switching, the PC sends '*' followed by a letter for the rate.
+ * Returns requested baud rate once a full command has been seen, otherwise 0. */
+uint baud_command(uint8_t byte, bool *star) {
+  uint baud = 0;
+  if(*star) {
+    switch(byte) {
+      case 'n': baud = 9600; break;
+      case 'o': baud = 4800; break;
+      case 'p': baud = 2400; break;
+      case 'q': baud = 1200; break;
+    }
+  }
+  *star = (byte == '*');
+  return baud;
+}
+
+// Queue bytes for sending without waiting for the line, returns how many fit in the queue.
+// Safe to call from interrupts on the core which owns the UART, e.g. for ident.
 int serial_write(uart_inst_t* uart, uint8_t *buffer, int size) { 
   int written=0;
-  for(int i=0; i <= size; i++) {
-    uart_putc_raw(uart, buffer[i]); 
+  uint32_t status = save_and_disable_interrupts();
+#if AMOUSE_PIO_SERIAL
+  if(tx_head == tx_tail && !tx_busy(uart)) { tx_started_at = time_us_32(); } // Starting from an idle line
+#endif
+  while(written < size && (tx_head - tx_tail) < SERIAL_TX_QUEUE) {
+    tx_queue[tx_head & (SERIAL_TX_QUEUE - 1)] = buffer[written];
+    tx_head++;
     written++;
   } 
+
+#if !AMOUSE_PIO_SERIAL
+  uint32_t now = time_us_32();
+  if((int32_t)(tx_free_at - now) < 0) { tx_free_at = now; } // Line went idle since last write
+  tx_free_at += packet_time(written);
+#endif
+
+  tx_pump(uart); // Get the line going, from here on the TX interrupt keeps it fed
+  restore_interrupts(status);
   return written;
 }
 
-int get_pins(int flag) {
-  int serial_state = 0;
-/*  serial_state |= (gpio_get(UART_TX_PIN)  << UART_TX_BIT);
-  serial_state |= (gpio_get(UART_RX_PIN)  << UART_RX_BIT);
-  serial_state |= (gpio_get(UART_RTS_PIN) << UART_RTS_BIT);
-  serial_state |= (gpio_get(UART_DTR_PIN) << UART_DTR_BIT); */
-  serial_state |= (gpio_get(UART_CTS_PIN) << UART_CTS_BIT);
+// Room left in the transmit queue in bytes.
+int serial_tx_space(void) {
+  return SERIAL_TX_QUEUE - (tx_head - tx_tail);
+}
+
+// Time at which everything queued so far has gone out, for pacing the next packet.
+uint32_t serial_line_free(void) {
+#if AMOUSE_PIO_SERIAL
+  // The PIO reports when each frame ends, only what hasn't finished yet is estimated. It goes out back to back
+  // from the end of the last frame, or from when the line last started up if that was later.
+  uint32_t status = save_and_disable_interrupts();
+  uint32_t done_at = (uint32_t)pio_serial_done_at(&pio_tx);
+  uint32_t frames = pio_serial_pending(&pio_tx) + (tx_head - tx_tail);
+  restore_interrupts(status);
 
-  return (serial_state & flag) ? 1 : 0; // check bits set?
+  if((int32_t)(tx_started_at - done_at) > 0) { done_at = tx_started_at; }
+  return done_at + frames * serial_char_us;
+#else
+  return tx_free_at;
+#endif
 }
 
-// Takes bitmask, pulls high relevant pins based on array map.
-void enable_pins(int flag) {
-  for (int i = 0; i < UART_BITS2PINS_LENGTH; i++) {
-    if(flag & (1 << i)) { gpio_pull_up(UART_BITS2PINS[i]); }
-  }
+// Take a byte received from the PC, returns false if there is none.
+bool serial_read(uint8_t *byte) {
+  uint32_t tail = rx_tail;
+  if(tail == rx_head) { return(false); }
+  *byte = rx_queue[tail & (SERIAL_RX_QUEUE - 1)];
+  rx_tail = tail + 1;
+  return(true);
 }
 
-// Takes bitmask, pulls low relevant pins based on array map.
-void disable_pins(int flag) {
-  for (int i = 0; i < UART_BITS2PINS_LENGTH; i++) {
-    if(flag & (1 << i)) { gpio_pull_down(UART_BITS2PINS[i]); }
-  }
+bool serial_rx_ready(void) {
+  return(rx_tail != rx_head);
+}
+
+// Nothing queued or on the wire, safe to change clocks.
+bool serial_tx_idle(uart_inst_t* uart) {
+  return(tx_head == tx_tail && !tx_busy(uart));
+}
+
+// Switch between 7n1 and 8n1 for a different protocol. The transmitter must be idle, see serial_tx_idle().
+void serial_set_data_bits(uart_inst_t* uart, uint data_bits) {
+  if(data_bits == serial_data_bits) { return; }
+  serial_data_bits = data_bits;
+  uart_set_format(uart, serial_data_bits, STOP_BITS, PARITY);
+  update_char_time();
+  tx_update_format();
+}
+
+// System clock was changed, clk_peri follows it so the baud rate divisor has to be worked out again.
+void serial_clock_changed(uart_inst_t* uart) {
+  serial_baud = uart_set_baudrate(uart, serial_baud);
+  update_char_time();
+  tx_update_format();
 }
 
-void wait_pin_state(int flag, int desired_state) {
-  // Monitor
-  int pin_state = -1;
-  while(pin_state != desired_state) { 
-    pin_state = get_pins(flag);
-    sleep_us(1);
+// Drop anything not yet handed to the UART.
+void serial_discard(void) {
+  uint32_t status = save_and_disable_interrupts();
+  tx_head = tx_tail;
+#if AMOUSE_PIO_SERIAL
+  pio_serial_discard(&pio_tx);
+  tx_started_at = time_us_32();
+#else
+  tx_free_at = time_us_32();
+#endif
+  restore_interrupts(status);
+}
+
+// Driver has reset the mouse, drop what's queued and go back to the starting rate right away.
+// Switches at once, so it can be used from interrupts once serial_tx_idle().
+void serial_restart(uart_inst_t* uart) {
+  serial_discard();
+  serial_baud_next = 0;
+  if(serial_baud != BAUD_RATE) {
+    serial_baud = uart_set_baudrate(uart, BAUD_RATE);
+    update_char_time();
+    tx_update_format();
   }
 }
 
-void mouse_ident(uart_inst_t* uart, int wheel_enabled) {
+void mouse_ident(uart_inst_t* uart, int protocol, int wheel_enabled) {
+  if(protocol == PROTO_MOUSESYSTEMS) { return; } // Mouse Systems mice don't identify themselves.
+
   /*** Microsoft Mouse proto negotiation ***/
- 
-  sleep_us(14); 
+  // Timing is up to the caller, see IDENT_DELAY_US.
 
   /* Byte1:Always M
    * Byte2:[None]=Microsoft 3=Logitech Z=MicrosoftWheel  */
-  //uint8_t logitech[] = "\x4D\x33";
   //uint8_t microsoft[] = "\x4D";
   /* IntelliMouse: MZ@... */
   //uint8_t pkt_intellimouse_intro[] = "\x4D\x5A"; // MZ
 
-  if(wheel_enabled) {
+  if(protocol == PROTO_LOGITECH) {
+    serial_write(uart, pkt_logitech_intro, 2); // M3
+  }
+  else if(wheel_enabled) {
     serial_write(uart, pkt_intellimouse_intro, 2); // 2 byte intro is sufficient
   }
   else {
@@ -114,5 +353,4 @@ void mouse_ident(uart_inst_t* uart, int wheel_enabled) {
   }
 
   // sleep_us(63); // Simulate mouse init delay
-  //write(fd, &logitech[1], 1); // Not enabled currently
 }
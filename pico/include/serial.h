@@ -17,19 +17,25 @@
 #ifndef SERIAL_H_
 #define SERIAL_H_
 
-/* Protocol definitions */
-#define MOUSE_LMB_BIT 5 // Defines << shift for bit position
-#define MOUSE_RMB_BIT 4
-#define MOUSE_MMB_BIT 4 // Shift 4 times in 4th byte
-
-// Delay between data packets for 1200 baud
 #define U_FULL_SECOND 1000000L      // 1s in microseconds
-#define SERIALDELAY_3B  22700       // 3 bytes (microseconds)
-#define SERIALDELAY_4B  30000       // 4 bytes (microseconds)
-// 1200 baud (bits/s) is 133.333333333... bytes/s
+
+// Delay between data packets is derived from the baud rate and framing, e.g. 1200 baud 7n1:
+// 1200 baud (bits/s) is 133.333333333... bytes/s with 9 bits per byte (start, 7 data, stop).
 // 44.44.. updates per second with 3 bytes.
-// 33.25.. updates per second with 4 bytes.
-// ~0.0075 seconds per byte, target time calculated for 4 bytes.
+// 33.33.. updates per second with 4 bytes.
+// Packet time is padded by 1/SERIAL_PACING_MARGIN to allow for clock error between us and the PC.
+#define SERIAL_PACING_MARGIN 100
+
+#define IDENT_DELAY_US 14 // Time from the driver releasing reset (CTS edge) to sending ident
+#define IDENT_RETRY_US 50 // Ident waits this long at a time for the last byte of the old session to go out
+
+// Transmit through a PIO state machine instead of the UART, for exact bit timing. Chosen at build time.
+#ifndef AMOUSE_PIO_SERIAL
+#define AMOUSE_PIO_SERIAL 0
+#endif
+
+#define SERIAL_TX_QUEUE 16 // Transmit queue in bytes, room for a few packets. Must be a power of two.
+#define SERIAL_RX_QUEUE 8  // Receive queue in bytes, the PC only sends short commands. Must be a power of two.
 
 // Which pin has which function
 // Serial spec (Fem): TX(2), RX(3), DSR(4), DTR(6), CTS(7), RTS(8)
@@ -45,28 +51,40 @@ enum UART_PINS {
   UART_RTS_PIN = 6
 };
 
-enum UART_BITS {
-  UART_TX_BIT  = 0,
-  UART_RX_BIT  = 1,
-//UART_GND_PIN 
-  UART_DSR_BIT = 3,
-  UART_DTR_BIT = 4,
-  UART_CTS_BIT = 5,
-  UART_RTS_BIT = 6
-};
+void mouse_serial_init(uart_inst_t* uart, uint data_bits);
+
+uint serial_get_baud(void);
+
+void serial_set_baud(uart_inst_t* uart, uint baud);
 
-void mouse_serial_init(uart_inst_t* uart);
+void serial_baud_update(uart_inst_t* uart);
+
+bool serial_baud_pending(void);
+
+uint32_t packet_time(int bytes);
+
+uint baud_command(uint8_t byte, bool *star);
 
 int serial_write(uart_inst_t* uart, uint8_t *buffer, int size);
 
-int get_pins(int flag);
+int serial_tx_space(void);
+
+uint32_t serial_line_free(void);
+
+void serial_discard(void);
+
+bool serial_read(uint8_t *byte);
+
+bool serial_rx_ready(void);
+
+bool serial_tx_idle(uart_inst_t* uart);
 
-void enable_pins(int flag);
+void serial_set_data_bits(uart_inst_t* uart, uint data_bits);
 
-void disable_pins(int flag);
+void serial_clock_changed(uart_inst_t* uart);
 
-void wait_pin_state(int flag, int desired_state);
+void serial_restart(uart_inst_t* uart);
 
-void mouse_ident(uart_inst_t* uart, int wheel_enabled);
+void mouse_ident(uart_inst_t* uart, int protocol, int wheel_enabled);
 
 #endif // SERIAL_H_
@@ -15,6 +15,7 @@
 */
 
 #include <stdint.h>
+#include <stdlib.h>
 #include "utils.h"
 
 /*** Helper functions ****/
@@ -34,6 +35,22 @@ int clamp(int value, int min, int max) {
   return value;
 }
 
+// Takes up to +-limit of accumulated motion for one packet, the rest is left to carry over to the next.
+int take_motion(int *accum, int limit) {
+  int taken = clamp(*accum, -limit, limit);
+  *accum -= taken;
+  return taken;
+}
+
+// Drops accumulated motion beyond +-max so the cursor can't lag too far behind, returns amount dropped.
+int cap_motion(int *accum, int max) {
+  int dropped;
+  if(max < 0) { return 0; } // No limit
+  dropped = *accum - clamp(*accum, -max, max);
+  *accum -= dropped;
+  return abs(dropped);
+}
+
 /*void mouse_state_to_serial(mouse_state_t *mouse) {
   uint8_t buffer[64];
   ssize_t couldWriteSize = snprintf(buffer, 64, "x%d y%d w%d lmb%d rmb%d mmb%d upd%d force%d\n", 
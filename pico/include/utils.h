@@ -21,4 +21,8 @@ const char * byte_to_bitstring(uint8_t val);
 
 int clamp(int value, int min, int max);
 
+int take_motion(int *accum, int limit);
+
+int cap_motion(int *accum, int max);
+
 #endif // UTILS_H_
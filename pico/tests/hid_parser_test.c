@@ -0,0 +1,180 @@
+/*
+ * Anachro Mouse, a usb to serial mouse adaptor. Copyright (C) 2021 Aviancer <oss+amouse@skyvian.me>
+ *
+ * This library is free software; you can redistribute it and/or modify it under the terms of the 
+ * GNU Lesser General Public License as published by the Free Software Foundation; either version 
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without 
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the 
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along with this library; 
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+*/
+
+// Host side test for the report descriptor parser, built with plain gcc: cd pico/tests && make
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "hid_parser.h"
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+  if(!(cond)) { fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); failures++; } \
+} while(0)
+
+// Mouse collection a Logitech Unifying receiver reports for its mice (Linux hid-logitech-dj mse_descriptor).
+// Report ID 2, 16 buttons, 12 bit X/Y, wheel and AC pan.
+static const uint8_t logitech_unifying[] = {
+  0x05, 0x01, 0x09, 0x02, 0xA1, 0x01, 0x85, 0x02, 0x09, 0x01, 0xA1, 0x00,
+  0x05, 0x09, 0x19, 0x01, 0x29, 0x10, 0x15, 0x00, 0x25, 0x01, 0x95, 0x10, 0x75, 0x01, 0x81, 0x02,
+  0x05, 0x01, 0x16, 0x01, 0xF8, 0x26, 0xFF, 0x07, 0x75, 0x0C, 0x95, 0x02, 0x09, 0x30, 0x09, 0x31, 0x81, 0x06,
+  0x15, 0x81, 0x25, 0x7F, 0x75, 0x08, 0x95, 0x01, 0x09, 0x38, 0x81, 0x06,
+  0x05, 0x0C, 0x0A, 0x38, 0x02, 0x95, 0x01, 0x81, 0x06,
+  0xC0, 0xC0
+};
+
+// Mouse interface of a Logitech G series gaming mouse, no report ID, 16 buttons, 16 bit X/Y, wheel and AC pan.
+static const uint8_t logitech_gaming[] = {
+  0x05, 0x01, 0x09, 0x02, 0xA1, 0x01, 0x09, 0x01, 0xA1, 0x00,
+  0x05, 0x09, 0x19, 0x01, 0x29, 0x10, 0x15, 0x00, 0x25, 0x01, 0x95, 0x10, 0x75, 0x01, 0x81, 0x02,
+  0x05, 0x01, 0x16, 0x01, 0x80, 0x26, 0xFF, 0x7F, 0x75, 0x10, 0x95, 0x02, 0x09, 0x30, 0x09, 0x31, 0x81, 0x06,
+  0x15, 0x81, 0x25, 0x7F, 0x75, 0x08, 0x95, 0x01, 0x09, 0x38, 0x81, 0x06,
+  0x05, 0x0C, 0x0A, 0x38, 0x02, 0x95, 0x01, 0x81, 0x06,
+  0xC0, 0xC0
+};
+
+// Vendor report ID 18 ahead of the same mouse collection on ID 2, IDs 16 apart keep their own bit offsets.
+static const uint8_t vendor_then_mouse[] = {
+  0x06, 0x00, 0xFF, 0x09, 0x01, 0xA1, 0x01, 0x85, 0x12, 0x15, 0x00, 0x26, 0xFF, 0x00,
+  0x75, 0x08, 0x95, 0x08, 0x09, 0x01, 0x81, 0x02, 0xC0,
+  0x05, 0x01, 0x09, 0x02, 0xA1, 0x01, 0x85, 0x02, 0x09, 0x01, 0xA1, 0x00,
+  0x05, 0x09, 0x19, 0x01, 0x29, 0x10, 0x15, 0x00, 0x25, 0x01, 0x95, 0x10, 0x75, 0x01, 0x81, 0x02,
+  0x05, 0x01, 0x16, 0x01, 0xF8, 0x26, 0xFF, 0x07, 0x75, 0x0C, 0x95, 0x02, 0x09, 0x30, 0x09, 0x31, 0x81, 0x06,
+  0x15, 0x81, 0x25, 0x7F, 0x75, 0x08, 0x95, 0x01, 0x09, 0x38, 0x81, 0x06,
+  0xC0, 0xC0
+};
+
+// Mouse whose X/Y have a report size of 0.
+static const uint8_t zero_size[] = {
+  0x05, 0x01, 0x09, 0x02, 0xA1, 0x01, 0x09, 0x01, 0xA1, 0x00,
+  0x05, 0x09, 0x19, 0x01, 0x29, 0x08, 0x15, 0x00, 0x25, 0x01, 0x95, 0x08, 0x75, 0x01, 0x81, 0x02,
+  0x05, 0x01, 0x15, 0x81, 0x25, 0x7F, 0x75, 0x00, 0x95, 0x02, 0x09, 0x30, 0x09, 0x31, 0x81, 0x06,
+  0xC0, 0xC0
+};
+
+// Mouse with 520 bytes of padding ahead of X/Y, further into the report than we read.
+static const uint8_t past_report[] = {
+  0x05, 0x01, 0x09, 0x02, 0xA1, 0x01, 0x09, 0x01, 0xA1, 0x00,
+  0x75, 0x08, 0x96, 0x08, 0x02, 0x81, 0x01,
+  0x15, 0x81, 0x25, 0x7F, 0x75, 0x08, 0x95, 0x02, 0x09, 0x30, 0x09, 0x31, 0x81, 0x06,
+  0xC0, 0xC0
+};
+
+// Boot keyboard descriptor from the HID 1.11 spec appendix B.1, has no mouse to find.
+static const uint8_t boot_keyboard[] = {
+  0x05, 0x01, 0x09, 0x06, 0xA1, 0x01, 0x05, 0x07, 0x19, 0xE0, 0x29, 0xE7, 0x15, 0x00, 0x25, 0x01,
+  0x75, 0x01, 0x95, 0x08, 0x81, 0x02, 0x95, 0x01, 0x75, 0x08, 0x81, 0x01, 0x95, 0x05, 0x75, 0x01,
+  0x05, 0x08, 0x19, 0x01, 0x29, 0x05, 0x91, 0x02, 0x95, 0x01, 0x75, 0x03, 0x91, 0x01, 0x95, 0x06,
+  0x75, 0x08, 0x15, 0x00, 0x25, 0x65, 0x05, 0x07, 0x19, 0x00, 0x29, 0x65, 0x81, 0x00, 0xC0
+};
+
+static void test_report_id(void) {
+  hid_plan_t plan;
+  int x, y, wheel;
+  uint8_t buttons;
+
+  CHECK(hid_plan_parse(&plan, logitech_unifying, sizeof(logitech_unifying)));
+  CHECK(plan.report_id == 2);
+
+  // Left + middle, x -5 (0xFFB), y 300 (0x12C), wheel -1
+  uint8_t report[] = { 0x02, 0x05, 0x00, 0xFB, 0xCF, 0x12, 0xFF, 0x00 };
+  CHECK(hid_plan_decode(&plan, report, sizeof(report), &x, &y, &wheel, &buttons));
+  CHECK(x == -5);
+  CHECK(y == 300);
+  CHECK(wheel == -1);
+  CHECK(buttons == 0x05);
+
+  // Some other report from the same receiver, e.g. a keyboard one, isn't ours
+  uint8_t other[] = { 0x01, 0x05, 0x00, 0xFB, 0xCF, 0x12, 0xFF, 0x00 };
+  CHECK(!hid_plan_decode(&plan, other, sizeof(other), &x, &y, &wheel, &buttons));
+}
+
+static void test_report_id_offsets(void) {
+  hid_plan_t plan;
+  int x, y, wheel;
+  uint8_t buttons;
+
+  CHECK(hid_plan_parse(&plan, vendor_then_mouse, sizeof(vendor_then_mouse)));
+  CHECK(plan.report_id == 2);
+
+  uint8_t report[] = { 0x02, 0x05, 0x00, 0xFB, 0xCF, 0x12, 0xFF };
+  CHECK(hid_plan_decode(&plan, report, sizeof(report), &x, &y, &wheel, &buttons));
+  CHECK(x == -5);
+  CHECK(y == 300);
+  CHECK(wheel == -1);
+  CHECK(buttons == 0x05);
+}
+
+static void test_16bit(void) {
+  hid_plan_t plan;
+  int x, y, wheel;
+  uint8_t buttons;
+
+  CHECK(hid_plan_parse(&plan, logitech_gaming, sizeof(logitech_gaming)));
+  CHECK(plan.report_id == 0);
+
+  // Right + forward, x 272, y -256, wheel 2, buttons 9-16 held too which don't fit the 8 we keep
+  uint8_t report[] = { 0x12, 0xFF, 0x10, 0x01, 0x00, 0xFF, 0x02, 0x00 };
+  CHECK(hid_plan_decode(&plan, report, sizeof(report), &x, &y, &wheel, &buttons));
+  CHECK(x == 272);
+  CHECK(y == -256);
+  CHECK(wheel == 2);
+  CHECK(buttons == 0x12);
+
+  // Full range both ways
+  uint8_t extremes[] = { 0x00, 0x00, 0x01, 0x80, 0xFF, 0x7F, 0x00, 0x00 };
+  CHECK(hid_plan_decode(&plan, extremes, sizeof(extremes), &x, &y, &wheel, &buttons));
+  CHECK(x == -32767);
+  CHECK(y == 32767);
+}
+
+static void test_fallback(void) {
+  hid_plan_t plan;
+  int x, y, wheel;
+  uint8_t buttons;
+
+  // No mouse in it, and a descriptor cut short before Y; plan stays as it was
+  hid_plan_boot(&plan);
+  CHECK(!hid_plan_parse(&plan, boot_keyboard, sizeof(boot_keyboard)));
+  CHECK(!hid_plan_parse(&plan, logitech_gaming, 42));
+
+  // Fields that can't be read
+  CHECK(!hid_plan_parse(&plan, zero_size, sizeof(zero_size)));
+  CHECK(!hid_plan_parse(&plan, past_report, sizeof(past_report)));
+
+  uint8_t report[] = { 0x01, 0xFF, 0x05, 0x81 };
+  CHECK(hid_plan_decode(&plan, report, sizeof(report), &x, &y, &wheel, &buttons));
+  CHECK(x == -1);
+  CHECK(y == 5);
+  CHECK(wheel == -127);
+  CHECK(buttons == 0x01);
+}
+
+int main(void) {
+  test_report_id();
+  test_report_id_offsets();
+  test_16bit();
+  test_fallback();
+
+  if(failures) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return(1);
+  }
+  printf("hid_parser: all checks passed\n");
+  return(0);
+}